@@ -1,22 +1,74 @@
 #include <alloca.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <curl/curl.h>
 
 #include "aur.h"
+#include "git.h"
 #include "log.h"
+#include "probes.h"
+#include "recompress.h"
+#include "srcinfo.h"
+#include "tarball.h"
 #include "util.h"
 
+/* timeouts, in seconds */
+#define DEFAULT_CONNECT_TIMEOUT   30L
+#define DEFAULT_LOGIN_TIMEOUT     60L
+#define DEFAULT_UPLOAD_TIMEOUT    60L
+#define DEFAULT_LOWSPEED_TIME     30L
+
+/* bytes per second */
+#define DEFAULT_LOWSPEED_LIMIT    1024L
+#define UPLOAD_TIMEOUT_MIN_RATE   (16 * 1024L)
+
+/* uploads smaller than this say little about throughput, and recompressing
+ * is not worth it for uploads expected to take less than a tenth of a
+ * second */
+#define RECOMPRESS_MIN_SAMPLE     (64 * 1024L)
+#define RECOMPRESS_MIN_SECONDS    0.1
+
+/* bytes of decompressed tar data the decision to recompress is based on */
+#define RECOMPRESS_PROBE_SIZE     (4 * 1024 * 1024L)
+
+/* repository whose refs a git login asks for to check the credentials */
+#define GIT_LOGIN_REPOSITORY      "burp"
+
+/* Throughput of the link uploads go out on, for deciding whether
+ * recompressing is worth it. Uploads running at once split the link, so a
+ * measurement is scaled up by the number in flight, and a new upload can
+ * expect its share of the whole. */
+struct upload_link_t {
+  double speed;           /* bytes per second, 0 until measured */
+  unsigned int uploads;   /* in flight */
+};
+
+struct aur_share_t {
+  unsigned int refcount;
+  CURLSH *curlsh;
+  pthread_mutex_t locks[CURL_LOCK_DATA_LAST];
+
+  /* clients with a share learn from each other's uploads */
+  pthread_mutex_t link_lock;
+  struct upload_link_t link;
+};
+
 struct aur_t {
   const char *proto;
   char *domainname;
   bool secure;
+  int protocol;
 
   char *username;
   char *password;
@@ -25,14 +77,38 @@ struct aur_t {
 
   bool debug;
 
+  long connect_timeout;
+  long timeout;
+  long lowspeed_limit;
+  long lowspeed_time;
+  long request_timeout;
+  long expect_timeout;
+
+  bool recompress;
+  struct upload_link_t link;  /* used without a share */
+
   CURL *curl;
+  aur_share_t *share;
+  struct aur_request_t *request;
 };
 
+static void request_cancel(struct aur_request_t *req);
+
 struct form_element_t {
-  CURLformoption keyoption;
-  const char *key;
-  CURLformoption valueoption;
+  const char *name;
   const char *value;
+  const char *filepath;  /* send this file's contents instead of value */
+  const char *filename;  /* and name it this instead of the file's name */
+  const void *data;      /* or send these len bytes, named filename */
+  size_t len;
+};
+
+/* Read position in a buffer streamed into a form part. curl frees it along
+ * with the form. */
+struct mime_reader_t {
+  const char *data;
+  size_t len;
+  size_t pos;
 };
 
 struct memblock_t {
@@ -45,16 +121,21 @@ static inline void memblock_free(struct memblock_t *memblock) {
 }
 #define _cleanup_memblock_ _cleanup_(memblock_free)
 
-static inline void formfreep(struct curl_httppost **form) {
-  curl_formfree(*form);
+static inline void mimefreep(curl_mime **mime) {
+  curl_mime_free(*mime);
 }
-#define _cleanup_form_ _cleanup_(formfreep)
+#define _cleanup_mime_ _cleanup_(mimefreep)
 
 static inline void slistfreep(struct curl_slist **slist) {
   curl_slist_free_all(*slist);
 }
 #define _cleanup_slist_ _cleanup_(slistfreep)
 
+static inline void git_pack_freep(struct git_pack_t *pack) {
+  git_pack_free(pack);
+}
+#define _cleanup_pack_ _cleanup_(git_pack_freep)
+
 static size_t write_handler(void *ptr, size_t nmemb, size_t size, void *userdata) {
   struct memblock_t *response = userdata;
   size_t bytecount = size * nmemb;
@@ -64,7 +145,8 @@ static size_t write_handler(void *ptr, size_t nmemb, size_t size, void *userdata
   if (alloc == NULL)
     return 0;
 
-  response->data = memcpy(alloc + response->len, ptr, bytecount);
+  memcpy(alloc + response->len, ptr, bytecount);
+  response->data = alloc;
   response->len += bytecount;
   response->data[response->len] = '\0';
 
@@ -75,14 +157,127 @@ static int touch(const char *filename) {
   return close(open(filename, O_WRONLY|O_CREAT|O_CLOEXEC|O_NOCTTY, 0644));
 }
 
+/* curl_global_init and curl_global_cleanup are not thread safe, so count the
+ * users of libcurl and only touch global state on the first and last. */
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int global_refcount;
+
+static int global_ref(void) {
+  int r = 0;
+
+  pthread_mutex_lock(&global_lock);
+  if (global_refcount == 0 && curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK)
+    r = -ENOMEM;
+  else
+    global_refcount++;
+  pthread_mutex_unlock(&global_lock);
+
+  return r;
+}
+
+static void global_unref(void) {
+  pthread_mutex_lock(&global_lock);
+  if (--global_refcount == 0)
+    curl_global_cleanup();
+  pthread_mutex_unlock(&global_lock);
+}
+
+static void share_lock(CURL *curl, curl_lock_data data,
+    curl_lock_access access, void *userptr) {
+  aur_share_t *share = userptr;
+
+  pthread_mutex_lock(&share->locks[data]);
+}
+
+static void share_unlock(CURL *curl, curl_lock_data data, void *userptr) {
+  aur_share_t *share = userptr;
+
+  pthread_mutex_unlock(&share->locks[data]);
+}
+
+int aur_share_new(aur_share_t **ret, bool connections) {
+  aur_share_t *share;
+  int r;
+
+  r = global_ref();
+  if (r < 0)
+    return r;
+
+  share = calloc(1, sizeof(*share));
+  if (share == NULL) {
+    global_unref();
+    return -ENOMEM;
+  }
+
+  share->curlsh = curl_share_init();
+  if (share->curlsh == NULL) {
+    free(share);
+    global_unref();
+    return -ENOMEM;
+  }
+
+  for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_init(&share->locks[i], NULL);
+  pthread_mutex_init(&share->link_lock, NULL);
+
+  curl_share_setopt(share->curlsh, CURLSHOPT_LOCKFUNC, share_lock);
+  curl_share_setopt(share->curlsh, CURLSHOPT_UNLOCKFUNC, share_unlock);
+  curl_share_setopt(share->curlsh, CURLSHOPT_USERDATA, share);
+  curl_share_setopt(share->curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share->curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  if (connections)
+    curl_share_setopt(share->curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+  share->refcount = 1;
+  *ret = share;
+
+  return 0;
+}
+
+aur_share_t *aur_share_ref(aur_share_t *share) {
+  if (share)
+    __atomic_add_fetch(&share->refcount, 1, __ATOMIC_RELAXED);
+
+  return share;
+}
+
+void aur_share_unref(aur_share_t *share) {
+  if (share == NULL)
+    return;
+
+  if (__atomic_sub_fetch(&share->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  curl_share_cleanup(share->curlsh);
+  for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_destroy(&share->locks[i]);
+  pthread_mutex_destroy(&share->link_lock);
+  free(share);
+
+  global_unref();
+}
+
 static int curl_reset(aur_t *aur) {
+  _cleanup_slist_ struct curl_slist *cookies = NULL;
+  int carried = 0;
+
+  PROBE1(reset_start, aur);
+
   if (aur->curl == NULL)
     aur->curl = curl_easy_init();
-  else
+  else {
+    /* curl_easy_reset drops the list of cookie files without freeing it,
+     * leaking it on every request. Clearing the list beforehand also empties
+     * the jar, so the cookies are carried over by hand. */
+    curl_easy_getinfo(aur->curl, CURLINFO_COOKIELIST, &cookies);
+    curl_easy_setopt(aur->curl, CURLOPT_COOKIEFILE, NULL);
     curl_easy_reset(aur->curl);
+  }
 
-  if (aur->curl == NULL)
+  if (aur->curl == NULL) {
+    PROBE3(reset_done, aur, -ENOMEM, carried);
     return -ENOMEM;
+  }
 
   if (aur->cookiefile) {
     touch(aur->cookiefile);
@@ -91,25 +286,51 @@ static int curl_reset(aur_t *aur) {
   } else
     curl_easy_setopt(aur->curl, CURLOPT_COOKIEFILE, "");
 
+  for (struct curl_slist *i = cookies; i; i = i->next, ++carried)
+    curl_easy_setopt(aur->curl, CURLOPT_COOKIELIST, i->data);
+
   curl_easy_setopt(aur->curl, CURLOPT_WRITEFUNCTION, write_handler);
 
+  /* signals can't be used for timeouts in threaded programs */
+  curl_easy_setopt(aur->curl, CURLOPT_NOSIGNAL, 1L);
+  if (aur->share)
+    curl_easy_setopt(aur->curl, CURLOPT_SHARE, aur->share->curlsh);
+
+  curl_easy_setopt(aur->curl, CURLOPT_CONNECTTIMEOUT, aur->connect_timeout);
+  curl_easy_setopt(aur->curl, CURLOPT_LOW_SPEED_LIMIT, aur->lowspeed_limit);
+  curl_easy_setopt(aur->curl, CURLOPT_LOW_SPEED_TIME, aur->lowspeed_time);
+  if (aur->expect_timeout)
+    curl_easy_setopt(aur->curl, CURLOPT_EXPECT_100_TIMEOUT_MS,
+        aur->expect_timeout);
+
+  PROBE3(reset_done, aur, 0, carried);
   return 0;
 }
 
 int aur_new(aur_t **ret, const char *domainname, bool secure) {
   aur_t *aur;
+  int r;
 
   aur = calloc(1, sizeof(*aur));
   if (aur == NULL)
     return -ENOMEM;
 
+  r = global_ref();
+  if (r < 0) {
+    free(aur);
+    return r;
+  }
+
   aur->secure = secure;
+  aur->connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+  aur->lowspeed_limit = DEFAULT_LOWSPEED_LIMIT;
+  aur->lowspeed_time = DEFAULT_LOWSPEED_TIME;
   aur->proto = secure ? "https" : "http";
   aur->domainname = strdup(domainname);
-  if (aur->domainname == NULL)
+  if (aur->domainname == NULL) {
+    aur_free(aur);
     return -ENOMEM;
-
-  curl_global_init(CURL_GLOBAL_ALL);
+  }
 
   log_debug("created new AUR client for %s://%s", aur->proto,
       aur->domainname);
@@ -126,14 +347,21 @@ void aur_free(aur_t *aur) {
   log_debug("destroying AUR client for %s://%s", aur->proto,
       aur->domainname);
 
+  if (aur->request)
+    request_cancel(aur->request);
+
   free(aur->username);
   free(aur->cookiefile);
   free(aur->domainname);
   free(aur->aursid);
   free(aur->password);
 
+  /* the handle must let go of the share before it can be released */
   curl_easy_cleanup(aur->curl);
-  curl_global_cleanup();
+  aur_share_unref(aur->share);
+  free(aur);
+
+  global_unref();
 }
 
 static int copy_string(char **field, const char *value) {
@@ -163,11 +391,135 @@ int aur_set_password(aur_t *aur, const char *password) {
   return copy_string(&aur->password, password);
 }
 
+int aur_dup(aur_t **ret, aur_t *aur) {
+  _cleanup_slist_ struct curl_slist *cookies = NULL;
+  aur_t *copy;
+  int r;
+
+  r = aur_new(&copy, aur->domainname, aur->secure);
+  if (r < 0)
+    return r;
+
+  copy->protocol = aur->protocol;
+  copy->debug = aur->debug;
+  copy->connect_timeout = aur->connect_timeout;
+  copy->timeout = aur->timeout;
+  copy->lowspeed_limit = aur->lowspeed_limit;
+  copy->lowspeed_time = aur->lowspeed_time;
+  copy->request_timeout = aur->request_timeout;
+  copy->expect_timeout = aur->expect_timeout;
+  copy->recompress = aur->recompress;
+  copy->link.speed = aur->link.speed;
+  copy->share = aur_share_ref(aur->share);
+
+  if (copy_string(&copy->username, aur->username) < 0 ||
+      copy_string(&copy->password, aur->password) < 0 ||
+      copy_string(&copy->aursid, aur->aursid) < 0) {
+    aur_free(copy);
+    return -ENOMEM;
+  }
+
+  /* the session lives in the cookie jar, which the copy keeps in memory so
+   * that only the original writes the cookie file */
+  r = curl_reset(copy);
+  if (r < 0) {
+    aur_free(copy);
+    return r;
+  }
+
+  if (aur->curl)
+    curl_easy_getinfo(aur->curl, CURLINFO_COOKIELIST, &cookies);
+  for (struct curl_slist *i = cookies; i; i = i->next)
+    curl_easy_setopt(copy->curl, CURLOPT_COOKIELIST, i->data);
+
+  *ret = copy;
+
+  return 0;
+}
+
+int aur_set_share(aur_t *aur, aur_share_t *share) {
+  if (aur->request)
+    return -EBUSY;
+
+  aur_share_unref(aur->share);
+  aur->share = aur_share_ref(share);
+
+  if (aur->curl)
+    curl_easy_setopt(aur->curl, CURLOPT_SHARE,
+        share ? share->curlsh : NULL);
+
+  return 0;
+}
+
 int aur_set_debug(aur_t *aur, bool enable) {
   aur->debug = enable;
   return 0;
 }
 
+int aur_set_protocol(aur_t *aur, int protocol) {
+  switch (protocol) {
+  case AUR_PROTOCOL_AUR3:
+  case AUR_PROTOCOL_GIT:
+    aur->protocol = protocol;
+    return 0;
+  default:
+    return -EINVAL;
+  }
+}
+
+int aur_set_connect_timeout(aur_t *aur, long seconds) {
+  if (seconds < 0)
+    return -EINVAL;
+
+  aur->connect_timeout = seconds ? seconds : DEFAULT_CONNECT_TIMEOUT;
+  return 0;
+}
+
+int aur_set_timeout(aur_t *aur, long seconds) {
+  if (seconds < 0)
+    return -EINVAL;
+
+  aur->timeout = seconds;
+  return 0;
+}
+
+int aur_set_lowspeed(aur_t *aur, long bytes_per_sec, long seconds) {
+  if (bytes_per_sec < 0 || seconds < 0)
+    return -EINVAL;
+
+  aur->lowspeed_limit = bytes_per_sec ? bytes_per_sec : DEFAULT_LOWSPEED_LIMIT;
+  aur->lowspeed_time = seconds ? seconds : DEFAULT_LOWSPEED_TIME;
+  return 0;
+}
+
+int aur_set_recompress(aur_t *aur, bool enable) {
+  aur->recompress = enable;
+  return 0;
+}
+
+int aur_set_expect_timeout(aur_t *aur, long timeout_ms) {
+  if (timeout_ms < 0)
+    return -EINVAL;
+
+  aur->expect_timeout = timeout_ms;
+  if (aur->curl && timeout_ms)
+    curl_easy_setopt(aur->curl, CURLOPT_EXPECT_100_TIMEOUT_MS, timeout_ms);
+
+  return 0;
+}
+
+static long login_timeout(aur_t *aur) {
+  return aur->timeout ? aur->timeout : DEFAULT_LOGIN_TIMEOUT;
+}
+
+static long upload_timeout(aur_t *aur, off_t size) {
+  if (aur->timeout)
+    return aur->timeout;
+
+  /* allow for a slow uplink on large tarballs */
+  return DEFAULT_UPLOAD_TIMEOUT + size / UPLOAD_TIMEOUT_MIN_RATE;
+}
+
 static bool is_package_url(const char *url) {
   return strstr(url, "/packages/") || strstr(url, "/pkgbase/");
 }
@@ -234,53 +586,149 @@ static int extract_html_error(const char *html, char **error_out) {
     { NULL, NULL },
   };
 
+  PROBE1(html_error_start, html);
+
   for (struct tagpair_t *tag = error_tags; tag->start; ++tag) {
-    if (extract_html(html, tag->start, tag->end, error_out) == 0)
+    if (extract_html(html, tag->start, tag->end, error_out) == 0) {
+      PROBE2(html_error_done, 0, *error_out);
       return 0;
+    }
   }
 
+  PROBE2(html_error_done, -ENOENT, NULL);
   return -ENOENT;
 }
 
-static struct curl_httppost *make_form(const struct form_element_t *elements) {
-  struct curl_httppost *post = NULL, *last = NULL;
+static size_t mime_read(char *buffer, size_t size, size_t nitems, void *arg) {
+  struct mime_reader_t *reader = arg;
+  size_t n = size * nitems;
 
-  for (const struct form_element_t *elem = elements; elem->key; ++elem) {
-    log_debug("  appending form field: %s=%s", elem->key, elem->value);
-    if (curl_formadd(&post, &last, elem->keyoption, elem->key,
-          elem->valueoption, elem->value, CURLFORM_END) != CURL_FORMADD_OK)
-      return NULL;
+  if (n > reader->len - reader->pos)
+    n = reader->len - reader->pos;
+
+  memcpy(buffer, reader->data + reader->pos, n);
+  reader->pos += n;
+
+  return n;
+}
+
+/* lets curl rewind the part to resend it after a redirect or auth */
+static int mime_seek(void *arg, curl_off_t offset, int origin) {
+  struct mime_reader_t *reader = arg;
+
+  if (origin != SEEK_SET || offset < 0 || (curl_off_t)reader->len < offset)
+    return CURL_SEEKFUNC_CANTSEEK;
+
+  reader->pos = offset;
+  return CURL_SEEKFUNC_OK;
+}
+
+/* Streams the part from the caller's buffer rather than copying it into the
+ * form as curl_mime_data would. */
+static CURLcode mime_memory(curl_mimepart *part, const void *data, size_t len) {
+  struct mime_reader_t *reader;
+  CURLcode c;
+
+  reader = malloc(sizeof(*reader));
+  if (reader == NULL)
+    return CURLE_OUT_OF_MEMORY;
+
+  *reader = (struct mime_reader_t){ data, len, 0 };
+
+  c = curl_mime_data_cb(part, len, mime_read, mime_seek, free, reader);
+  if (c != CURLE_OK)
+    free(reader);
+
+  return c;
+}
+
+/* Every part has a known size, so curl sends the body with a precomputed
+ * Content-Length rather than chunked. */
+static curl_mime *make_form(aur_t *aur,
+    const struct form_element_t *elements) {
+  _cleanup_mime_ curl_mime *mime = NULL;
+  const char *filepath = NULL;
+  int parts = 0, r = 0;
+  curl_mime *ret;
+
+  PROBE1(form_start, aur);
+
+  mime = curl_mime_init(aur->curl);
+  if (mime == NULL)
+    r = -ENOMEM;
+
+  for (const struct form_element_t *elem = elements; r == 0 && elem->name;
+      ++elem) {
+    curl_mimepart *part;
+    CURLcode c;
+
+    part = curl_mime_addpart(mime);
+    if (part == NULL) {
+      r = -ENOMEM;
+      break;
+    }
+
+    if (elem->data) {
+      log_debug("  appending form file: %s=%s (%zu bytes in memory)",
+          elem->name, elem->filename, elem->len);
+      c = mime_memory(part, elem->data, elem->len);
+      if (c == CURLE_OK)
+        c = curl_mime_filename(part, elem->filename);
+      filepath = elem->filename;
+    } else if (elem->filepath) {
+      log_debug("  appending form file: %s=%s", elem->name, elem->filepath);
+      c = curl_mime_filedata(part, elem->filepath);
+      if (c == CURLE_OK && elem->filename)
+        c = curl_mime_filename(part, elem->filename);
+      filepath = elem->filepath;
+    } else {
+      log_debug("  appending form field: %s=%s", elem->name, elem->value);
+      c = curl_mime_data(part, elem->value ? elem->value : "",
+          CURL_ZERO_TERMINATED);
+    }
+
+    if (c != CURLE_OK || curl_mime_name(part, elem->name) != CURLE_OK)
+      r = -ENOMEM;
+    else
+      ++parts;
   }
 
-  return post;
+  PROBE4(form_done, aur, filepath, parts, r);
+  if (r < 0)
+    return NULL;
+
+  ret = mime;
+  mime = NULL;
+  return ret;
 }
 
-static struct curl_httppost *make_login_form(aur_t *aur) {
+static curl_mime *make_login_form(aur_t *aur) {
   const struct form_element_t elements[] = {
-    { CURLFORM_COPYNAME, "user", CURLFORM_COPYCONTENTS, aur->username },
-    { CURLFORM_COPYNAME, "passwd", CURLFORM_COPYCONTENTS, aur->password },
-    { CURLFORM_COPYNAME, "remember_me", CURLFORM_COPYCONTENTS, "on" },
-    { 0, NULL, 0, NULL },
+    { "user", aur->username, NULL, NULL, NULL, 0 },
+    { "passwd", aur->password, NULL, NULL, NULL, 0 },
+    { "remember_me", "on", NULL, NULL, NULL, 0 },
+    { NULL, NULL, NULL, NULL, NULL, 0 },
   };
 
   log_debug("building login form");
 
-  return make_form(elements);
+  return make_form(aur, elements);
 }
 
-static struct curl_httppost *make_upload_form(aur_t *aur, const char *filepath,
+static curl_mime *make_upload_form(aur_t *aur, const char *filepath,
+    const char *filename, const void *data, size_t len,
     const char *category) {
   const struct form_element_t elements[] = {
-    { CURLFORM_COPYNAME, "category", CURLFORM_COPYCONTENTS, category },
-    { CURLFORM_COPYNAME, "token", CURLFORM_COPYCONTENTS, aur->aursid },
-    { CURLFORM_COPYNAME, "pkgsubmit", CURLFORM_COPYCONTENTS, "1" },
-    { CURLFORM_COPYNAME, "pfile", CURLFORM_FILE, filepath },
-    { 0, NULL, 0, NULL },
+    { "category", category, NULL, NULL, NULL, 0 },
+    { "token", aur->aursid, NULL, NULL, NULL, 0 },
+    { "pkgsubmit", "1", NULL, NULL, NULL, 0 },
+    { "pfile", NULL, filepath, filename, data, len },
+    { NULL, NULL, NULL, NULL, NULL, 0 },
   };
 
   log_debug("building upload form");
 
-  return make_form(elements);
+  return make_form(aur, elements);
 }
 
 static bool domain_equals(const char *a, const char *b) {
@@ -300,7 +748,7 @@ static bool cookie_domain_equals(const char *a, const char *b) {
   return domain_equals(a, b);
 }
 
-static int update_aursid_from_cookies(aur_t *aur) {
+static int read_aursid_cookie(aur_t *aur) {
   _cleanup_slist_ struct curl_slist *cookielist = NULL;
   time_t now = time(NULL);
 
@@ -340,6 +788,16 @@ static int update_aursid_from_cookies(aur_t *aur) {
   return -ENOKEY;
 }
 
+static int update_aursid_from_cookies(aur_t *aur) {
+  int r;
+
+  PROBE1(cookies_start, aur);
+  r = read_aursid_cookie(aur);
+  PROBE3(cookies_done, aur, r, aur->aursid);
+
+  return r;
+}
+
 static void preload_cookiefile(aur_t *aur) {
   /* Hack alert! Prime the cookielist for inspection. */
   curl_easy_setopt(aur->curl, CURLOPT_URL, "file:///dev/null");
@@ -371,8 +829,8 @@ static char *aur_make_url(aur_t *aur, const char *uri) {
   return url;
 }
 
-static CURL *make_post_request(aur_t *aur, const char *path,
-    struct curl_httppost *post) {
+static CURL *make_post_request(aur_t *aur, const char *path, curl_mime *form,
+    struct curl_slist *headers, long timeout) {
   char *url = NULL;
 
   url = aur_make_url(aur, path);
@@ -383,7 +841,10 @@ static CURL *make_post_request(aur_t *aur, const char *path,
   curl_easy_setopt(aur->curl, CURLOPT_URL, url);
   free(url);
 
-  curl_easy_setopt(aur->curl, CURLOPT_HTTPPOST, post);
+  curl_easy_setopt(aur->curl, CURLOPT_MIMEPOST, form);
+  curl_easy_setopt(aur->curl, CURLOPT_HTTPHEADER, headers);
+  aur->request_timeout = timeout;
+  curl_easy_setopt(aur->curl, CURLOPT_TIMEOUT, timeout);
 
   if (aur->debug)
     curl_easy_setopt(aur->curl, CURLOPT_VERBOSE, 1L);
@@ -391,14 +852,40 @@ static CURL *make_post_request(aur_t *aur, const char *path,
   return aur->curl;
 }
 
-static long communicate(aur_t *aur, struct memblock_t *response) {
-  long response_code;
+static int timeout_error(aur_t *aur) {
+  double connect_time = 0, total_time = 0;
 
-  log_info("fetching response from remote");
-  curl_easy_setopt(aur->curl, CURLOPT_WRITEDATA, response);
+  curl_easy_getinfo(aur->curl,
+      aur->secure ? CURLINFO_APPCONNECT_TIME : CURLINFO_CONNECT_TIME,
+      &connect_time);
+  if (connect_time <= 0) {
+    log_debug("connection not established within %lds",
+        aur->connect_timeout);
+    return -ETIMEDOUT;
+  }
+
+  /* total timeouts and low speed aborts share a curl error code, so tell
+   * them apart by how long the transfer ran. */
+  curl_easy_getinfo(aur->curl, CURLINFO_TOTAL_TIME, &total_time);
+  if (total_time >= aur->request_timeout) {
+    log_debug("request did not complete within %lds", aur->request_timeout);
+    return -ETIME;
+  }
 
-  if (curl_easy_perform(aur->curl) != CURLE_OK)
-    return -1;
+  log_debug("transfer stalled below %ld bytes/sec for %lds",
+      aur->lowspeed_limit, aur->lowspeed_time);
+  return -ECOMM;
+}
+
+static long transfer_result(aur_t *aur, CURLcode c) {
+  long response_code;
+
+  if (c == CURLE_OPERATION_TIMEDOUT)
+    return timeout_error(aur);
+  else if (c != CURLE_OK) {
+    log_debug("request failed: %s", curl_easy_strerror(c));
+    return -EIO;
+  }
 
   curl_easy_getinfo(aur->curl, CURLINFO_RESPONSE_CODE, &response_code);
   log_info("server responded with status %ld", response_code);
@@ -406,50 +893,210 @@ static long communicate(aur_t *aur, struct memblock_t *response) {
   return response_code;
 }
 
-static int aur_login_password(aur_t *aur, char **error) {
-  _cleanup_form_ struct curl_httppost *form = NULL;
-  _cleanup_memblock_ struct memblock_t response = { NULL, 0 };
-  char *effective_url = NULL;
+static long communicate(aur_t *aur, struct memblock_t *response) {
+  long status;
+
+  log_info("fetching response from remote");
+  curl_easy_setopt(aur->curl, CURLOPT_WRITEDATA, response);
+
+  PROBE2(transfer_start, aur, aur->username);
+  status = transfer_result(aur, curl_easy_perform(aur->curl));
+  PROBE3(transfer_done, aur, status, response->len);
+
+  return status;
+}
+
+/* Operations are split into steps. Each step either finishes the operation,
+ * returning 0 or a negative errno, or prepares a transfer and names the step
+ * to run once it completes. A step may instead hand slow local work to
+ * req->work, which the multi interface runs on a thread of its own so that
+ * it does not hold up the event loop. The blocking calls and the multi
+ * interface drive the same steps. */
+enum {
+  REQUEST_DONE     = 0,
+  REQUEST_TRANSFER = 1,
+  REQUEST_WORK     = 2,
+};
+
+struct aur_request_t {
+  aur_t *aur;
+
+  int (*complete)(aur_t *aur, struct aur_request_t *req);
   long http_status;
-  int r;
+  struct memblock_t response;
+  char *error;
+
+  curl_mime *form;
+  struct curl_slist *headers;
+  char *body;
+
+  /* recompressed copy of the tarball being uploaded */
+  char *tempfile;
+  char *upload_path;
+  char *category;
+  off_t upload_size;
+  double upload_speed;
+  bool uploading;  /* counted among the link's uploads */
+
+  /* work done before the next step, and the thread doing it */
+  void (*work)(struct aur_request_t *req);
+  pthread_t thread;
+  bool working;
+  bool worked;
+
+  /* git pushes */
+  struct tarball_t tarball;
+  char *pkgbase;
+
+  /* multi interface */
+  aur_multi_t *multi;
+  aur_done_fn done;
+  void *userdata;
+  bool finished;
+  int result;
+  struct aur_request_t *next;
+};
 
-  log_info("attempting login by password as user %s", aur->username);
+static int request_new(aur_t *aur, struct aur_request_t **ret) {
+  struct aur_request_t *req;
 
-  r = curl_reset(aur);
-  if (r < 0)
-    return r;
+  if (aur->request)
+    return -EBUSY;
 
-  form = make_login_form(aur);
-  if (form == NULL)
+  req = calloc(1, sizeof(*req));
+  if (req == NULL)
     return -ENOMEM;
 
-  aur->curl = make_post_request(aur, "/login", form);
-  if (aur->curl == NULL)
-    return -ENOMEM;
+  req->aur = aur;
+  aur->request = req;
+  *ret = req;
 
-  http_status = communicate(aur, &response);
-  if (http_status < 0 || http_status >= 400)
+  return 0;
+}
+
+static void link_upload_done(aur_t *aur, struct aur_request_t *req,
+    double speed);
+
+static void request_free(struct aur_request_t *req) {
+  /* an upload dropped before it completed */
+  link_upload_done(req->aur, req, 0);
+
+  free(req->response.data);
+  free(req->error);
+  curl_mime_free(req->form);
+  curl_slist_free_all(req->headers);
+  free(req->body);
+  if (req->tempfile) {
+    unlink(req->tempfile);
+    free(req->tempfile);
+  }
+  free(req->upload_path);
+  free(req->category);
+  tarball_free(&req->tarball);
+  free(req->pkgbase);
+  free(req);
+}
+
+static void request_reset_response(struct aur_request_t *req) {
+  free(req->response.data);
+  req->response.data = NULL;
+  req->response.len = 0;
+}
+
+/* curl holds back request bodies above 1KiB until the server answers an
+ * Expect: 100-continue or a timeout passes, which costs every upload a round
+ * trip or a second. Unless the caller asked for the handshake with a timeout
+ * of its own, suppress the header and send the body right away. */
+static int request_expect_continue(aur_t *aur, struct aur_request_t *req) {
+  if (aur->expect_timeout > 0)
+    return 0;
+
+  req->headers = curl_slist_append(req->headers, "Expect:");
+  return req->headers ? 0 : -ENOMEM;
+}
+
+static int request_run(aur_t *aur, struct aur_request_t *req, int r,
+    char **error) {
+  while (r == REQUEST_TRANSFER || r == REQUEST_WORK) {
+    if (r == REQUEST_WORK)
+      req->work(req);
+    else {
+      request_reset_response(req);
+      req->http_status = communicate(aur, &req->response);
+    }
+    r = req->complete(aur, req);
+  }
+
+  if (error && req->error) {
+    *error = req->error;
+    req->error = NULL;
+  }
+
+  aur->request = NULL;
+  request_free(req);
+
+  PROBE2(request_done, aur, r);
+  return r;
+}
+
+static int login_password_complete(aur_t *aur, struct aur_request_t *req) {
+  char *effective_url = NULL;
+  int r;
+
+  if (req->http_status < 0)
+    return req->http_status;
+  if (req->http_status >= 400)
     return -EIO;
 
   curl_easy_getinfo(aur->curl, CURLINFO_REDIRECT_URL, &effective_url);
   if (effective_url == NULL) {
-    r = extract_html_error(response.data, error);
+    r = extract_html_error(req->response.data ? req->response.data : "",
+        &req->error);
     if (r < 0)
       return r;
 
-    if (error)
-      return -EIO;
+    return -EIO;
   }
 
   return update_aursid_from_cookies(aur);
 }
 
-int aur_login(aur_t *aur, char **error) {
+static int login_password_begin(aur_t *aur, struct aur_request_t *req) {
+  int r;
+
+  log_info("attempting login by password as user %s", aur->username);
+
+  r = curl_reset(aur);
+  if (r < 0)
+    return r;
+
+  req->form = make_login_form(aur);
+  if (req->form == NULL)
+    return -ENOMEM;
+
+  r = request_expect_continue(aur, req);
+  if (r < 0)
+    return r;
+
+  if (make_post_request(aur, "/login", req->form, req->headers,
+        login_timeout(aur)) == NULL)
+    return -ENOMEM;
+
+  req->complete = login_password_complete;
+  return REQUEST_TRANSFER;
+}
+
+static int git_login_begin(aur_t *aur, struct aur_request_t *req);
+
+static int login_begin(aur_t *aur, struct aur_request_t *req) {
   if (!aur->username)
     return -EBADR;
 
+  if (aur->protocol == AUR_PROTOCOL_GIT)
+    return git_login_begin(aur, req);
+
   if (aur->password)
-    return aur_login_password(aur, error);
+    return login_password_begin(aur, req);
 
   if (aur->cookiefile)
     return aur_login_cookies(aur);
@@ -457,54 +1104,1021 @@ int aur_login(aur_t *aur, char **error) {
   return -ENOKEY;
 }
 
-int aur_upload(aur_t *aur, const char *tarball_path,
-    const char *category, char **error) {
-  _cleanup_form_ struct curl_httppost *form = NULL;
-  _cleanup_memblock_ struct memblock_t response = { NULL, 0 };
-  long http_status;
-  char *effective_url = NULL;
-  struct stat st;
+int aur_login(aur_t *aur, char **error) {
+  struct aur_request_t *req;
   int r;
 
-  if (aur->aursid == NULL)
-    return -ENOKEY;
+  r = request_new(aur, &req);
+  if (r < 0)
+    return r;
 
-  log_info("uploading %s with category %s", tarball_path, category);
+  return request_run(aur, req, login_begin(aur, req), error);
+}
 
-  if (stat(tarball_path, &st) < 0)
-    return -errno;
+static const char *json_skip_ws(const char *p) {
+  while (isspace((unsigned char)*p))
+    p++;
 
-  if (!S_ISREG(st.st_mode))
+  return p;
+}
+
+static size_t utf8_encode(char *out, unsigned int codepoint) {
+  if (codepoint < 0x80) {
+    out[0] = codepoint;
+    return 1;
+  } else if (codepoint < 0x800) {
+    out[0] = 0xc0 | (codepoint >> 6);
+    out[1] = 0x80 | (codepoint & 0x3f);
+    return 2;
+  }
+
+  out[0] = 0xe0 | (codepoint >> 12);
+  out[1] = 0x80 | ((codepoint >> 6) & 0x3f);
+  out[2] = 0x80 | (codepoint & 0x3f);
+  return 3;
+}
+
+/* Parses the JSON string at p, storing the unescaped value in out unless it
+ * is NULL. Returns a pointer past the closing quote, or NULL if the input is
+ * malformed. */
+static const char *json_parse_string(const char *p, char **out) {
+  _cleanup_free_ char *buf = NULL;
+  const char *end;
+  char *q;
+
+  if (*p++ != '"')
+    return NULL;
+
+  for (end = p; *end != '"'; end++) {
+    if (*end == '\0')
+      return NULL;
+    if (*end == '\\' && *++end == '\0')
+      return NULL;
+  }
+
+  if (out == NULL)
+    return end + 1;
+
+  /* escapes never expand, so the raw length is an upper bound */
+  buf = malloc(end - p + 1);
+  if (buf == NULL)
+    return NULL;
+
+  for (q = buf; p < end; p++) {
+    if (*p != '\\') {
+      *q++ = *p;
+      continue;
+    }
+
+    switch (*++p) {
+    case 'b': *q++ = '\b'; break;
+    case 'f': *q++ = '\f'; break;
+    case 'n': *q++ = '\n'; break;
+    case 'r': *q++ = '\r'; break;
+    case 't': *q++ = '\t'; break;
+    case 'u': {
+      char hex[5] = {};
+      char *hexend;
+      unsigned int codepoint;
+
+      if (end - p < 5)
+        return NULL;
+      memcpy(hex, p + 1, 4);
+      codepoint = strtoul(hex, &hexend, 16);
+      if (*hexend != '\0')
+        return NULL;
+      q += utf8_encode(q, codepoint);
+      p += 4;
+      break;
+    }
+    default:
+      *q++ = *p;
+      break;
+    }
+  }
+
+  *q = '\0';
+  *out = buf;
+  buf = NULL;
+
+  return end + 1;
+}
+
+static const char *json_skip_value(const char *p, int depth) {
+  char close;
+
+  p = json_skip_ws(p);
+
+  switch (*p) {
+  case '"':
+    return json_parse_string(p, NULL);
+  case '{':
+  case '[':
+    if (depth > 32)
+      return NULL;
+
+    close = *p == '{' ? '}' : ']';
+    p = json_skip_ws(p + 1);
+    if (*p == close)
+      return p + 1;
+
+    for (;;) {
+      if (close == '}') {
+        p = json_parse_string(json_skip_ws(p), NULL);
+        if (p == NULL)
+          return NULL;
+        p = json_skip_ws(p);
+        if (*p++ != ':')
+          return NULL;
+      }
+
+      p = json_skip_value(p, depth + 1);
+      if (p == NULL)
+        return NULL;
+
+      p = json_skip_ws(p);
+      if (*p == close)
+        return p + 1;
+      if (*p++ != ',')
+        return NULL;
+    }
+  default: {
+    const char *start = p;
+
+    /* numbers, true, false and null */
+    while (*p && !strchr(",]} \t\r\n", *p))
+      p++;
+
+    return p == start ? NULL : p;
+  }
+  }
+}
+
+/* Parses one element of the "results" array of an info reply, recording its
+ * version if it matches one of the requested packages. */
+static const char *parse_rpc_result(const char *p, const char *const *pkgnames,
+    size_t count, char **versions) {
+  _cleanup_free_ char *name = NULL, *version = NULL;
+
+  p = json_skip_ws(p);
+  if (*p++ != '{')
+    return NULL;
+
+  p = json_skip_ws(p);
+  if (*p == '}')
+    return p + 1;
+
+  for (;;) {
+    _cleanup_free_ char *key = NULL;
+
+    p = json_parse_string(json_skip_ws(p), &key);
+    if (p == NULL)
+      return NULL;
+
+    p = json_skip_ws(p);
+    if (*p++ != ':')
+      return NULL;
+
+    p = json_skip_ws(p);
+    if (streq(key, "Name") && *p == '"' && name == NULL)
+      p = json_parse_string(p, &name);
+    else if (streq(key, "Version") && *p == '"' && version == NULL)
+      p = json_parse_string(p, &version);
+    else
+      p = json_skip_value(p, 0);
+    if (p == NULL)
+      return NULL;
+
+    p = json_skip_ws(p);
+    if (*p == '}')
+      break;
+    if (*p++ != ',')
+      return NULL;
+  }
+
+  if (name && version)
+    for (size_t i = 0; i < count; i++)
+      if (versions[i] == NULL && streq(pkgnames[i], name)) {
+        versions[i] = version;
+        version = NULL;
+        break;
+      }
+
+  return p + 1;
+}
+
+static int parse_rpc_versions(const char *json, const char *const *pkgnames,
+    size_t count, char **versions) {
+  const char *p = json_skip_ws(json);
+
+  if (*p++ != '{')
+    return -EBADMSG;
+
+  p = json_skip_ws(p);
+  if (*p == '}')
+    return -EBADMSG;
+
+  for (;;) {
+    _cleanup_free_ char *key = NULL;
+
+    p = json_parse_string(json_skip_ws(p), &key);
+    if (p == NULL)
+      return -EBADMSG;
+
+    p = json_skip_ws(p);
+    if (*p++ != ':')
+      return -EBADMSG;
+
+    p = json_skip_ws(p);
+    if (streq(key, "results") && *p == '[') {
+      p = json_skip_ws(p + 1);
+      while (*p != ']') {
+        p = parse_rpc_result(p, pkgnames, count, versions);
+        if (p == NULL)
+          return -EBADMSG;
+
+        p = json_skip_ws(p);
+        if (*p == ',')
+          p = json_skip_ws(p + 1);
+        else if (*p != ']')
+          return -EBADMSG;
+      }
+      p++;
+    } else if (streq(key, "error")) {
+      _cleanup_free_ char *error = NULL;
+
+      if (json_parse_string(p, &error))
+        log_error("AUR RPC error: %s", error);
+      return -EBADMSG;
+    } else
+      p = json_skip_value(p, 0);
+    if (p == NULL)
+      return -EBADMSG;
+
+    p = json_skip_ws(p);
+    if (*p == '}')
+      return 0;
+    if (*p++ != ',')
+      return -EBADMSG;
+  }
+}
+
+/* Stay clear of the request URI limits of common web servers. */
+#define RPC_MAX_URL_LENGTH 4000
+
+static int rpc_info_batch(aur_t *aur, const char *const *pkgnames,
+    size_t count, char **versions, size_t *consumed) {
+  _cleanup_memblock_ struct memblock_t response = { NULL, 0 };
+  _cleanup_free_ char *url = NULL;
+  long http_status;
+  size_t len, i;
+  int r;
+
+  url = aur_make_url(aur, "/rpc/?v=5&type=info");
+  if (url == NULL)
+    return -ENOMEM;
+  len = strlen(url);
+
+  for (i = 0; i < count; i++) {
+    _cleanup_free_ char *escaped = NULL;
+    char *newurl;
+    size_t arglen;
+
+    escaped = curl_easy_escape(aur->curl, pkgnames[i], 0);
+    if (escaped == NULL)
+      return -ENOMEM;
+
+    arglen = strlen("&arg%5B%5D=") + strlen(escaped);
+    if (i > 0 && len + arglen > RPC_MAX_URL_LENGTH)
+      break;
+
+    newurl = realloc(url, len + arglen + 1);
+    if (newurl == NULL)
+      return -ENOMEM;
+    url = newurl;
+
+    len += sprintf(url + len, "&arg%%5B%%5D=%s", escaped);
+  }
+
+  log_info("creating GET request to %s", url);
+  curl_easy_setopt(aur->curl, CURLOPT_URL, url);
+  curl_easy_setopt(aur->curl, CURLOPT_HTTPGET, 1L);
+  aur->request_timeout = login_timeout(aur);
+  curl_easy_setopt(aur->curl, CURLOPT_TIMEOUT, aur->request_timeout);
+
+  if (aur->debug)
+    curl_easy_setopt(aur->curl, CURLOPT_VERBOSE, 1L);
+
+  http_status = communicate(aur, &response);
+  if (http_status < 0)
+    return http_status;
+  if (http_status >= 400 || response.data == NULL)
+    return -EIO;
+
+  r = parse_rpc_versions(response.data, pkgnames, i, versions);
+  if (r < 0)
+    return r;
+
+  *consumed = i;
+
+  return 0;
+}
+
+int aur_get_versions(aur_t *aur, const char *const *pkgnames, size_t count,
+    char **versions) {
+  int r;
+
+  if (aur->request)
+    return -EBUSY;
+
+  for (size_t i = 0; i < count; i++)
+    versions[i] = NULL;
+
+  r = curl_reset(aur);
+  if (r < 0)
+    return r;
+
+  for (size_t done = 0; done < count;) {
+    size_t consumed = 0;
+
+    r = rpc_info_batch(aur, pkgnames + done, count - done, versions + done,
+        &consumed);
+    if (r < 0) {
+      for (size_t i = 0; i < count; i++) {
+        free(versions[i]);
+        versions[i] = NULL;
+      }
+      return r;
+    }
+
+    done += consumed;
+  }
+
+  return 0;
+}
+
+/* The AUR's rules for package names. The pkgbase names the git repository
+ * and so ends up in the push URL, where anything else could change its
+ * meaning. */
+static bool valid_pkgbase(const char *name) {
+  if (name[0] == '\0' || name[0] == '-' || name[0] == '.')
+    return false;
+
+  for (const char *p = name; *p; p++)
+    if (!islower((unsigned char)*p) && !isdigit((unsigned char)*p) &&
+        strchr("@._+-", *p) == NULL)
+      return false;
+
+  return true;
+}
+
+/* Path components git refuses in a tree, or which leave the package. */
+static bool valid_component(const char *name, size_t len) {
+  return len > 0 &&
+      !(len == 1 && name[0] == '.') &&
+      !(len == 2 && strncmp(name, "..", 2) == 0) &&
+      !(len == 4 && strncasecmp(name, ".git", 4) == 0);
+}
+
+/* Takes the pkgbase from the .SRCINFO and checks that every entry of the
+ * tarball lives below it, as makepkg lays it out. */
+static int git_read_pkgbase(struct aur_request_t *req) {
+  _cleanup_srcinfo_ struct srcinfo_t srcinfo = {};
+  size_t len;
+  int r;
+
+  r = srcinfo_read_archive(&srcinfo, &req->tarball);
+  if (r < 0) {
+    if (asprintf(&req->error, "unable to read .SRCINFO: %s",
+          strerror(-r)) < 0)
+      req->error = NULL;
+    return r;
+  }
+
+  if (!valid_pkgbase(srcinfo.pkgbase)) {
+    if (asprintf(&req->error, "invalid pkgbase '%s'", srcinfo.pkgbase) < 0)
+      req->error = NULL;
+    return -EINVAL;
+  }
+
+  len = strlen(srcinfo.pkgbase);
+
+  for (size_t i = 0; i < req->tarball.count; i++) {
+    const char *name = req->tarball.entries[i].name, *p;
+
+    if (strncmp(name, srcinfo.pkgbase, len) != 0 ||
+        (name[len] != '\0' && name[len] != '/'))
+      goto invalid;
+
+    for (p = name + len; *p == '/'; ) {
+      size_t n = strcspn(++p, "/");
+
+      if (!valid_component(p, n))
+        goto invalid;
+      p += n;
+    }
+    continue;
+
+invalid:
+    if (asprintf(&req->error, "tarball entry '%s' is not below %s/", name,
+          srcinfo.pkgbase) < 0)
+      req->error = NULL;
     return -EINVAL;
+  }
+
+  req->pkgbase = srcinfo.pkgbase;
+  srcinfo.pkgbase = NULL;
+
+  return 0;
+}
+
+static int make_git_request(aur_t *aur, const char *url,
+    struct curl_slist *headers, const char *body, size_t len, long timeout) {
+  int r;
+
+  r = curl_reset(aur);
+  if (r < 0)
+    return r;
+
+  log_info("creating %s request to %s", body ? "POST" : "GET", url);
+  curl_easy_setopt(aur->curl, CURLOPT_URL, url);
+  curl_easy_setopt(aur->curl, CURLOPT_USERNAME, aur->username);
+  curl_easy_setopt(aur->curl, CURLOPT_PASSWORD, aur->password);
+  curl_easy_setopt(aur->curl, CURLOPT_HTTPHEADER, headers);
+
+  if (body) {
+    curl_easy_setopt(aur->curl, CURLOPT_POSTFIELDS, body);
+    curl_easy_setopt(aur->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)len);
+  }
+
+  aur->request_timeout = timeout;
+  curl_easy_setopt(aur->curl, CURLOPT_TIMEOUT, timeout);
+
+  if (aur->debug)
+    curl_easy_setopt(aur->curl, CURLOPT_VERBOSE, 1L);
+
+  return 0;
+}
+
+static int git_request_status(struct aur_request_t *req) {
+  if (req->http_status < 0)
+    return req->http_status;
+  if (req->http_status == 401 || req->http_status == 403)
+    return -EKEYREJECTED;
+  if (req->http_status >= 400 || req->response.data == NULL)
+    return -EIO;
+
+  return 0;
+}
+
+/* Any answer but 401 means the server took the credentials. The probed
+ * repository need not exist, and a 403 only says the account may not push
+ * to that one. */
+static int git_login_complete(aur_t *aur, struct aur_request_t *req) {
+  if (req->http_status < 0)
+    return req->http_status;
+
+  if (req->http_status == 401) {
+    req->error = strdup("the AUR did not accept the username or password");
+    return -EKEYREJECTED;
+  }
+
+  if (req->http_status >= 500)
+    return -EIO;
+
+  return 0;
+}
+
+/* git pushes authenticate each request and there is no session to open, but
+ * checking the credentials once up front saves building a packfile for every
+ * package only to have each push refused. */
+static int git_login_begin(aur_t *aur, struct aur_request_t *req) {
+  _cleanup_free_ char *url = NULL;
+  int r;
+
+  if (aur->password == NULL)
+    return -ENOKEY;
+
+  log_info("checking credentials of %s", aur->username);
+
+  if (asprintf(&url, "%s://%s/%s.git/info/refs?service=git-receive-pack",
+        aur->proto, aur->domainname, GIT_LOGIN_REPOSITORY) < 0)
+    return -ENOMEM;
+
+  r = make_git_request(aur, url, NULL, NULL, 0, login_timeout(aur));
+  if (r < 0)
+    return r;
+
+  req->complete = git_login_complete;
+  return REQUEST_TRANSFER;
+}
+
+static int git_build_pack(aur_t *aur, const struct tarball_t *tarball,
+    const char *pkgbase, const unsigned char *parent,
+    struct git_pack_t *pack, unsigned char commit[SHA1_DIGEST_LENGTH]) {
+  _cleanup_free_ char *ident = NULL, *message = NULL;
+  unsigned char tree[SHA1_DIGEST_LENGTH];
+  int r;
+
+  r = git_pack_init(pack);
+  if (r < 0)
+    return r;
+
+  r = git_pack_add_tree(pack, tarball, pkgbase, tree);
+  if (r < 0)
+    return r;
+
+  if (asprintf(&ident, "%s <%s@%.*s>", aur->username, aur->username,
+        (int)strcspn(aur->domainname, ":"), aur->domainname) < 0)
+    return -ENOMEM;
+
+  if (asprintf(&message, "Update %s", pkgbase) < 0)
+    return -ENOMEM;
+
+  r = git_pack_add_commit(pack, tree, parent, ident, message, commit);
+  if (r < 0)
+    return r;
+
+  log_debug("built pack with %u objects (%zu bytes)", pack->count, pack->len);
+
+  return git_pack_finish(pack);
+}
+
+static int git_push_complete(aur_t *aur, struct aur_request_t *req) {
+  int r;
+
+  r = git_request_status(req);
+  if (r < 0)
+    return r;
+
+  return git_read_report_status(req->response.data, req->response.len,
+      &req->error);
+}
+
+static int git_refs_complete(aur_t *aur, struct aur_request_t *req) {
+  static const unsigned char zero[SHA1_DIGEST_LENGTH];
+  _cleanup_pack_ struct git_pack_t pack = {};
+  _cleanup_free_ char *url = NULL;
+  unsigned char head[SHA1_DIGEST_LENGTH], commit[SHA1_DIGEST_LENGTH];
+  size_t len;
+  int r;
+
+  r = git_request_status(req);
+  if (r < 0)
+    return r;
+
+  r = git_find_ref(req->response.data, req->response.len,
+      "refs/heads/master", head);
+  if (r == -ENOENT) {
+    log_debug("%s has no master branch yet", req->pkgbase);
+    memset(head, 0, SHA1_DIGEST_LENGTH);
+  } else if (r < 0)
+    return r;
+
+  r = git_build_pack(aur, &req->tarball, req->pkgbase,
+      memcmp(head, zero, sizeof(zero)) ? head : NULL, &pack, commit);
+  if (r < 0)
+    return r;
+
+  r = git_make_push_request(head, commit, "refs/heads/master", &pack,
+      &req->body, &len);
+  if (r < 0)
+    return r;
+
+  if (asprintf(&url, "%s://%s/%s.git/git-receive-pack", aur->proto,
+        aur->domainname, req->pkgbase) < 0)
+    return -ENOMEM;
+
+  req->headers = curl_slist_append(req->headers,
+      "Content-Type: application/x-git-receive-pack-request");
+  req->headers = curl_slist_append(req->headers,
+      "Accept: application/x-git-receive-pack-result");
+  if (req->headers == NULL)
+    return -ENOMEM;
+
+  r = request_expect_continue(aur, req);
+  if (r < 0)
+    return r;
+
+  r = make_git_request(aur, url, req->headers, req->body, len,
+      upload_timeout(aur, len));
+  if (r < 0)
+    return r;
+
+  PROBE3(upload_send, aur, req->pkgbase, (long long)len);
+
+  req->complete = git_push_complete;
+  return REQUEST_TRANSFER;
+}
+
+static int git_upload_begin(aur_t *aur, struct aur_request_t *req,
+    const char *tarball_path, const void *data, size_t len) {
+  _cleanup_free_ char *url = NULL;
+  int r;
+
+  if (aur->password == NULL)
+    return -ENOKEY;
+
+  log_info("pushing %s", tarball_path);
+
+  if (data)
+    r = tarball_load_memory(&req->tarball, data, len);
+  else
+    r = tarball_load(&req->tarball, tarball_path);
+  if (r < 0)
+    return r;
+
+  r = git_read_pkgbase(req);
+  if (r < 0)
+    return r;
+
+  if (asprintf(&url, "%s://%s/%s.git/info/refs?service=git-receive-pack",
+        aur->proto, aur->domainname, req->pkgbase) < 0)
+    return -ENOMEM;
+
+  r = make_git_request(aur, url, NULL, NULL, 0, login_timeout(aur));
+  if (r < 0)
+    return r;
+
+  req->complete = git_refs_complete;
+  return REQUEST_TRANSFER;
+}
+
+static struct upload_link_t *link_lock(aur_t *aur) {
+  if (aur->share == NULL)
+    return &aur->link;
+
+  pthread_mutex_lock(&aur->share->link_lock);
+  return &aur->share->link;
+}
+
+static void link_unlock(aur_t *aur) {
+  if (aur->share)
+    pthread_mutex_unlock(&aur->share->link_lock);
+}
+
+/* The speed a new upload can expect alongside those already running, or 0
+ * if it is not known yet. */
+static double link_upload_speed(aur_t *aur) {
+  struct upload_link_t *link = link_lock(aur);
+  double speed = link->speed / (link->uploads + 1);
+
+  link_unlock(aur);
+  return speed;
+}
+
+static void link_upload_start(aur_t *aur, struct aur_request_t *req) {
+  struct upload_link_t *link = link_lock(aur);
+
+  link->uploads++;
+  req->uploading = true;
+  link_unlock(aur);
+}
+
+/* Takes the upload out of the count, learning the link's throughput from
+ * it if speed is not 0. */
+static void link_upload_done(aur_t *aur, struct aur_request_t *req,
+    double speed) {
+  struct upload_link_t *link;
+
+  if (!req->uploading)
+    return;
+
+  link = link_lock(aur);
+  if (speed > 0) {
+    link->speed = speed * link->uploads;
+    log_debug("measured upload speed of %.0f bytes/s over %u uploads",
+        link->speed, link->uploads);
+  }
+  link->uploads--;
+  req->uploading = false;
+  link_unlock(aur);
+}
+
+/* Remembers the throughput of large uploads to decide whether recompressing
+ * the next tarball is worth it. Small uploads are dominated by latency. */
+static void record_upload_speed(aur_t *aur, struct aur_request_t *req) {
+  double pretransfer = 0, total = 0, speed = 0;
+  curl_off_t size = 0;
+
+  curl_easy_getinfo(aur->curl, CURLINFO_SIZE_UPLOAD_T, &size);
+  curl_easy_getinfo(aur->curl, CURLINFO_PRETRANSFER_TIME, &pretransfer);
+  curl_easy_getinfo(aur->curl, CURLINFO_TOTAL_TIME, &total);
+
+  if (size >= RECOMPRESS_MIN_SAMPLE && total > pretransfer)
+    speed = size / (total - pretransfer);
+
+  link_upload_done(aur, req, speed);
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int read_file(const char *path, size_t size, char **ret) {
+  _cleanup_fclose_ FILE *fp = NULL;
+  char *data;
+
+  fp = fopen(path, "re");
+  if (fp == NULL)
+    return -errno;
+
+  data = malloc(size);
+  if (data == NULL)
+    return -ENOMEM;
+
+  if (fread(data, 1, size, fp) != size) {
+    free(data);
+    return -EIO;
+  }
+
+  *ret = data;
+  return 0;
+}
+
+/* Recompresses the tarball to a temporary file when the upload time this
+ * saves outweighs all the time spent on it: reading the file, decompressing
+ * a prefix of it to sample, decompressing the rest and compressing. Returns
+ * the path of the new file, or NULL to upload the original. This may run on
+ * a thread of its own and must not touch the client. */
+static char *recompress_tarball(const char *path, off_t size,
+    double upload_speed) {
+  _cleanup_free_ char *data = NULL, *raw = NULL;
+  struct recompress_estimate_t estimate;
+  size_t raw_len, consumed, total;
+  const char *tmpdir;
+  char *tmp = NULL;
+  double start, inflated, cost, saved;
+  struct stat st;
+  int fd, r;
+
+  start = now_seconds();
+
+  r = read_file(path, size, &data);
+  if (r < 0) {
+    log_info("not recompressing %s: %s", path, strerror(-r));
+    return NULL;
+  }
+
+  /* the decision rests on the start of the stream, so a tarball which is
+   * not worth it is never decompressed as a whole */
+  if (tarball_is_gzip(data, size)) {
+    double t = now_seconds();
+
+    r = tarball_gunzip(data, size, RECOMPRESS_PROBE_SIZE, &raw, &raw_len,
+        &consumed);
+    if (r < 0) {
+      log_info("not recompressing %s: %s", path, strerror(-r));
+      return NULL;
+    }
+    inflated = now_seconds() - t;
+
+    /* extrapolate a cut off stream by its compression ratio so far */
+    total = consumed < (size_t)size ?
+      (size_t)((double)raw_len * size / consumed) : raw_len;
+  } else {
+    raw = data;
+    data = NULL;
+    raw_len = total = consumed = size;
+    inflated = 0;
+  }
+
+  if (raw_len == 0)
+    return NULL;
+
+  r = recompress_estimate(raw, raw_len, total, &estimate);
+  if (r < 0)
+    return NULL;
+
+  /* the probe is spent either way; a cut off stream is then decompressed
+   * again from the start */
+  cost = now_seconds() - start + estimate.seconds;
+  if (raw_len < total)
+    cost += inflated * size / consumed;
+
+  saved = (size - (double)estimate.size) / upload_speed;
+  if (saved <= cost) {
+    log_info("not recompressing %s: saves %.2fs of upload for %.2fs of work",
+        path, saved, cost);
+    return NULL;
+  }
+
+  if (raw_len < total) {
+    free(raw);
+    raw = NULL;
+
+    r = tarball_gunzip(data, size, 0, &raw, &raw_len, NULL);
+    if (r < 0) {
+      log_info("not recompressing %s: %s", path, strerror(-r));
+      return NULL;
+    }
+  }
+
+  tmpdir = getenv("TMPDIR");
+  if (asprintf(&tmp, "%s/burp-XXXXXX", tmpdir ? tmpdir : "/tmp") < 0)
+    return NULL;
+
+  fd = mkostemp(tmp, O_CLOEXEC);
+  if (fd < 0) {
+    log_warn("failed to create temporary file: %s", strerror(errno));
+    free(tmp);
+    return NULL;
+  }
 
-  form = make_upload_form(aur, tarball_path, category);
-  if (form == NULL)
-    return -ENOMEM;
+  r = recompress_write(raw, raw_len, fd);
+  if (r == 0 && fstat(fd, &st) < 0)
+    r = -errno;
+  close(fd);
 
-  aur->curl = make_post_request(aur, "/submit", form);
-  if (aur->curl == NULL)
-    return -ENOMEM;
+  if (r < 0 || st.st_size >= size) {
+    if (r < 0)
+      log_warn("failed to recompress %s: %s", path, strerror(-r));
+    unlink(tmp);
+    free(tmp);
+    return NULL;
+  }
 
-  http_status = communicate(aur, &response);
-  if (http_status < 0 || http_status >= 400)
+  log_info("recompressed %s from %jd to %jd bytes", path, (intmax_t)size,
+      (intmax_t)st.st_size);
+
+  return tmp;
+}
+
+static void recompress_work(struct aur_request_t *req) {
+  req->tempfile = recompress_tarball(req->upload_path, req->upload_size,
+      req->upload_speed);
+}
+
+static int upload_complete(aur_t *aur, struct aur_request_t *req) {
+  char *effective_url = NULL;
+  int r;
+
+  record_upload_speed(aur, req);
+
+  if (req->http_status < 0)
+    return req->http_status;
+  if (req->http_status >= 400)
     return -EIO;
 
   curl_easy_getinfo(aur->curl, CURLINFO_REDIRECT_URL, &effective_url);
   if (effective_url && is_package_url(effective_url))
     return 0;
 
-  r = extract_html_error(response.data, error);
+  r = extract_html_error(req->response.data ? req->response.data : "",
+      &req->error);
   if (r < 0)
     return r;
 
   return -EKEYREJECTED;
 }
 
-int aur_logout(aur_t *aur) {
-  _cleanup_memblock_ struct memblock_t response = { NULL, 0 };
-  long http_status;
+static int upload_send(aur_t *aur, struct aur_request_t *req,
+    const char *tarball_path, const void *data, size_t len,
+    const char *category) {
+  struct stat st;
+  int r;
+
+  if (data)
+    st.st_size = len;
+  else if (stat(req->tempfile ? req->tempfile : tarball_path, &st) < 0)
+    return -errno;
+
+  req->form = make_upload_form(aur,
+      req->tempfile ? req->tempfile : tarball_path,
+      basename(tarball_path), data, len, category);
+  if (req->form == NULL)
+    return -ENOMEM;
+
+  r = request_expect_continue(aur, req);
+  if (r < 0)
+    return r;
+
+  if (make_post_request(aur, "/submit", req->form, req->headers,
+        upload_timeout(aur, st.st_size)) == NULL)
+    return -ENOMEM;
+
+  PROBE3(upload_send, aur, tarball_path, (long long)st.st_size);
+
+  link_upload_start(aur, req);
+  req->complete = upload_complete;
+  return REQUEST_TRANSFER;
+}
+
+static int upload_recompressed(aur_t *aur, struct aur_request_t *req) {
+  return upload_send(aur, req, req->upload_path, NULL, 0, req->category);
+}
+
+/* Uploads the tarball at tarball_path or, when data is not NULL, the len
+ * bytes at data under the file name tarball_path. */
+static int upload_begin(aur_t *aur, struct aur_request_t *req,
+    const char *tarball_path, const void *data, size_t len,
+    const char *category) {
+  struct stat st;
+  double speed;
+
+  if (aur->protocol == AUR_PROTOCOL_GIT)
+    return git_upload_begin(aur, req, tarball_path, data, len);
+
+  if (aur->aursid == NULL)
+    return -ENOKEY;
+
+  log_info("uploading %s with category %s", tarball_path, category);
+
+  if (data)
+    return upload_send(aur, req, tarball_path, data, len, category);
+
+  if (stat(tarball_path, &st) < 0)
+    return -errno;
+
+  if (!S_ISREG(st.st_mode))
+    return -EINVAL;
+
+  if (!aur->recompress)
+    return upload_send(aur, req, tarball_path, NULL, 0, category);
+
+  speed = link_upload_speed(aur);
+  if (speed <= 0) {
+    log_info("not recompressing %s: upload speed is not known yet",
+        tarball_path);
+    return upload_send(aur, req, tarball_path, NULL, 0, category);
+  }
+
+  if (st.st_size / speed < RECOMPRESS_MIN_SECONDS)
+    return upload_send(aur, req, tarball_path, NULL, 0, category);
+
+  req->upload_path = strdup(tarball_path);
+  if (req->upload_path == NULL)
+    return -ENOMEM;
+
+  if (category) {
+    req->category = strdup(category);
+    if (req->category == NULL)
+      return -ENOMEM;
+  }
+
+  req->upload_size = st.st_size;
+  req->upload_speed = speed;
+  req->work = recompress_work;
+  req->complete = upload_recompressed;
+  return REQUEST_WORK;
+}
+
+int aur_upload(aur_t *aur, const char *tarball_path,
+    const char *category, char **error) {
+  struct aur_request_t *req;
+  int r;
+
+  PROBE3(upload_start, aur, tarball_path, category);
+
+  r = request_new(aur, &req);
+  if (r == 0)
+    r = request_run(aur, req,
+        upload_begin(aur, req, tarball_path, NULL, 0, category), error);
+
+  PROBE3(upload_done, aur, tarball_path, r);
+  return r;
+}
+
+int aur_upload_memory(aur_t *aur, const char *filename, const void *data,
+    size_t len, const char *category, char **error) {
+  struct aur_request_t *req;
+  int r;
+
+  PROBE3(upload_start, aur, filename, category);
+
+  r = request_new(aur, &req);
+  if (r == 0)
+    r = request_run(aur, req,
+        upload_begin(aur, req, filename, data, len, category), error);
+
+  PROBE3(upload_done, aur, filename, r);
+  return r;
+}
+
+static int logout_complete(aur_t *aur, struct aur_request_t *req) {
+  int r;
+
+  if (req->http_status < 0)
+    return req->http_status;
+  if (req->http_status >= 400)
+    return -EIO;
+
+  r = update_aursid_from_cookies(aur);
+  if (r != -ENOKEY && r != -EKEYEXPIRED)
+    return -EIO;
+
+  return 0;
+}
+
+static int logout_begin(aur_t *aur, struct aur_request_t *req) {
   int r;
 
+  if (aur->protocol == AUR_PROTOCOL_GIT)
+    return 0;
+
   log_info("logging out");
 
   r = curl_reset(aur);
@@ -518,19 +2132,426 @@ int aur_logout(aur_t *aur) {
       return 0;
   }
 
-  aur->curl = make_post_request(aur, "/logout", NULL);
-  if (aur->curl == NULL)
+  if (make_post_request(aur, "/logout", NULL, NULL, login_timeout(aur)) == NULL)
     return -ENOMEM;
 
-  http_status = communicate(aur, &response);
-  if (http_status >= 400)
+  req->complete = logout_complete;
+  return REQUEST_TRANSFER;
+}
+
+int aur_logout(aur_t *aur) {
+  struct aur_request_t *req;
+  int r;
+
+  r = request_new(aur, &req);
+  if (r < 0)
+    return r;
+
+  return request_run(aur, req, logout_begin(aur, req), NULL);
+}
+
+struct aur_multi_t {
+  CURLM *curlm;
+
+  aur_socket_fn socket_fn;
+  aur_timer_fn timer_fn;
+  void *userdata;
+
+  /* operations in flight or waiting to report completion */
+  struct aur_request_t *requests;
+  bool timer_overridden;
+
+  /* signalled by worker threads as they finish, and watched through the
+   * socket callback while any are running */
+  int eventfd;
+  bool eventfd_watched;
+};
+
+static int multi_socket_handler(CURL *easy, curl_socket_t fd, int what,
+    void *userp, void *socketp) {
+  aur_multi_t *multi = userp;
+  int events = 0;
+
+  switch (what) {
+  case CURL_POLL_IN:
+    events = AUR_POLL_IN;
+    break;
+  case CURL_POLL_OUT:
+    events = AUR_POLL_OUT;
+    break;
+  case CURL_POLL_INOUT:
+    events = AUR_POLL_IN | AUR_POLL_OUT;
+    break;
+  case CURL_POLL_REMOVE:
+    events = AUR_POLL_REMOVE;
+    break;
+  }
+
+  multi->socket_fn(multi, fd, events, multi->userdata);
+
+  return 0;
+}
+
+static int multi_timer_handler(CURLM *curlm, long timeout_ms, void *userp) {
+  aur_multi_t *multi = userp;
+
+  multi->timer_fn(multi, timeout_ms, multi->userdata);
+
+  return 0;
+}
+
+int aur_multi_new(aur_multi_t **ret, aur_socket_fn socket_fn,
+    aur_timer_fn timer_fn, void *userdata) {
+  aur_multi_t *multi;
+  int r;
+
+  if (socket_fn == NULL || timer_fn == NULL)
+    return -EINVAL;
+
+  r = global_ref();
+  if (r < 0)
+    return r;
+
+  multi = calloc(1, sizeof(*multi));
+  if (multi == NULL) {
+    global_unref();
+    return -ENOMEM;
+  }
+
+  multi->eventfd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+  if (multi->eventfd < 0) {
+    r = -errno;
+    free(multi);
+    global_unref();
+    return r;
+  }
+
+  multi->curlm = curl_multi_init();
+  if (multi->curlm == NULL) {
+    close(multi->eventfd);
+    free(multi);
+    global_unref();
+    return -ENOMEM;
+  }
+
+  multi->socket_fn = socket_fn;
+  multi->timer_fn = timer_fn;
+  multi->userdata = userdata;
+
+  curl_multi_setopt(multi->curlm, CURLMOPT_SOCKETFUNCTION,
+      multi_socket_handler);
+  curl_multi_setopt(multi->curlm, CURLMOPT_SOCKETDATA, multi);
+  curl_multi_setopt(multi->curlm, CURLMOPT_TIMERFUNCTION,
+      multi_timer_handler);
+  curl_multi_setopt(multi->curlm, CURLMOPT_TIMERDATA, multi);
+
+  *ret = multi;
+
+  return 0;
+}
+
+static void multi_unlink(aur_multi_t *multi, struct aur_request_t *req) {
+  for (struct aur_request_t **i = &multi->requests; *i; i = &(*i)->next)
+    if (*i == req) {
+      *i = req->next;
+      return;
+    }
+}
+
+/* Watches the eventfd only while worker threads are running, so that an
+ * idle multi leaves nothing but curl's sockets in the caller's loop. */
+static void multi_watch_workers(aur_multi_t *multi) {
+  bool working = false;
+
+  for (struct aur_request_t *req = multi->requests; req; req = req->next)
+    if (req->working)
+      working = true;
+
+  if (working == multi->eventfd_watched)
+    return;
+
+  multi->eventfd_watched = working;
+  multi->socket_fn(multi, multi->eventfd,
+      working ? AUR_POLL_IN : AUR_POLL_REMOVE, multi->userdata);
+}
+
+/* Drops a request without reporting its completion. */
+static void multi_cancel(aur_multi_t *multi, struct aur_request_t *req) {
+  if (req->working)
+    pthread_join(req->thread, NULL);
+  curl_multi_remove_handle(multi->curlm, req->aur->curl);
+  multi_unlink(multi, req);
+  multi_watch_workers(multi);
+  req->aur->request = NULL;
+  request_free(req);
+}
+
+static void request_cancel(struct aur_request_t *req) {
+  if (req->multi)
+    multi_cancel(req->multi, req);
+  else {
+    req->aur->request = NULL;
+    request_free(req);
+  }
+}
+
+void aur_multi_free(aur_multi_t *multi) {
+  if (multi == NULL)
+    return;
+
+  while (multi->requests)
+    multi_cancel(multi, multi->requests);
+
+  curl_multi_cleanup(multi->curlm);
+  close(multi->eventfd);
+  free(multi);
+
+  global_unref();
+}
+
+static int multi_add(aur_multi_t *multi, struct aur_request_t *req) {
+  aur_t *aur = req->aur;
+
+  request_reset_response(req);
+
+  log_info("fetching response from remote");
+  curl_easy_setopt(aur->curl, CURLOPT_WRITEDATA, &req->response);
+  curl_easy_setopt(aur->curl, CURLOPT_PRIVATE, req);
+
+  PROBE2(transfer_start, aur, aur->username);
+  if (curl_multi_add_handle(multi->curlm, aur->curl) != CURLM_OK)
     return -EIO;
 
-  r = update_aursid_from_cookies(aur);
-  if (r != -ENOKEY && r != -EKEYEXPIRED)
+  return 0;
+}
+
+static void multi_finish(aur_multi_t *multi, struct aur_request_t *req,
+    int result) {
+  req->finished = true;
+  req->result = result;
+}
+
+static void *multi_worker(void *userdata) {
+  struct aur_request_t *req = userdata;
+  uint64_t one = 1;
+
+  req->work(req);
+
+  __atomic_store_n(&req->worked, true, __ATOMIC_RELEASE);
+  while (write(req->multi->eventfd, &one, sizeof(one)) < 0 && errno == EINTR)
+    ;
+
+  return NULL;
+}
+
+/* Moves a request on to the step it asked for. Returns true if the
+ * operation finished. */
+static bool multi_step(aur_multi_t *multi, struct aur_request_t *req, int r) {
+  for (;;) {
+    if (r == REQUEST_TRANSFER) {
+      r = multi_add(multi, req);
+      if (r == 0)
+        return false;
+    } else if (r == REQUEST_WORK) {
+      req->worked = false;
+      if (pthread_create(&req->thread, NULL, multi_worker, req) == 0) {
+        req->working = true;
+        multi_watch_workers(multi);
+        return false;
+      }
+
+      /* without a thread to spare, do the work here */
+      req->work(req);
+      r = req->complete(req->aur, req);
+      continue;
+    }
+
+    multi_finish(multi, req, r);
+    return true;
+  }
+}
+
+/* Continues the requests whose worker threads have finished. */
+static void multi_reap_workers(aur_multi_t *multi) {
+  uint64_t count;
+
+  if (read(multi->eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    log_debug("failed to read eventfd: %s", strerror(errno));
+
+  for (struct aur_request_t *req = multi->requests; req; req = req->next) {
+    if (!req->working || !__atomic_load_n(&req->worked, __ATOMIC_ACQUIRE))
+      continue;
+
+    pthread_join(req->thread, NULL);
+    req->working = false;
+    multi_step(multi, req, req->complete(req->aur, req));
+  }
+
+  multi_watch_workers(multi);
+}
+
+static void multi_read_info(aur_multi_t *multi) {
+  CURLMsg *msg;
+  int left;
+
+  while ((msg = curl_multi_info_read(multi->curlm, &left))) {
+    struct aur_request_t *req;
+    CURL *easy = msg->easy_handle;
+    CURLcode c = msg->data.result;
+    char *private;
+
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+
+    curl_easy_getinfo(easy, CURLINFO_PRIVATE, &private);
+    req = (struct aur_request_t *)private;
+    req->http_status = transfer_result(req->aur, c);
+    curl_multi_remove_handle(multi->curlm, easy);
+    PROBE3(transfer_done, req->aur, req->http_status, req->response.len);
+
+    multi_step(multi, req, req->complete(req->aur, req));
+  }
+}
+
+static void multi_dispatch(aur_multi_t *multi) {
+  for (;;) {
+    struct aur_request_t *req;
+
+    for (req = multi->requests; req; req = req->next)
+      if (req->finished)
+        break;
+
+    if (req == NULL)
+      return;
+
+    /* detach first, so the callback may start another operation or free
+     * the client */
+    multi_unlink(multi, req);
+    req->aur->request = NULL;
+
+    PROBE2(request_done, req->aur, req->result);
+    if (req->done)
+      req->done(req->aur, req->result, req->error, req->userdata);
+
+    request_free(req);
+  }
+}
+
+static int multi_pending(aur_multi_t *multi) {
+  int count = 0;
+
+  for (struct aur_request_t *req = multi->requests; req; req = req->next)
+    count++;
+
+  return count;
+}
+
+int aur_multi_socket_action(aur_multi_t *multi, int fd, int events) {
+  int running, mask = 0;
+
+  if (events & AUR_POLL_IN)
+    mask |= CURL_CSELECT_IN;
+  if (events & AUR_POLL_OUT)
+    mask |= CURL_CSELECT_OUT;
+
+  if (fd == multi->eventfd)
+    multi_reap_workers(multi);
+  else if (curl_multi_socket_action(multi->curlm, fd, mask,
+        &running) != CURLM_OK)
     return -EIO;
 
+  multi_read_info(multi);
+  multi_dispatch(multi);
+
+  /* hand the timer back to curl if we borrowed it */
+  if (multi->timer_overridden) {
+    long timeout_ms = -1;
+
+    multi->timer_overridden = false;
+    curl_multi_timeout(multi->curlm, &timeout_ms);
+    multi->timer_fn(multi, timeout_ms, multi->userdata);
+  }
+
+  return multi_pending(multi);
+}
+
+int aur_multi_timeout(aur_multi_t *multi) {
+  return aur_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0);
+}
+
+static int request_start(aur_multi_t *multi, struct aur_request_t *req, int r,
+    aur_done_fn done, void *userdata) {
+  req->multi = multi;
+  req->done = done;
+  req->userdata = userdata;
+  req->next = multi->requests;
+  multi->requests = req;
+
+  if (!multi_step(multi, req, r))
+    return 0;
+
+  /* The operation finished without a transfer. Report it from the next
+   * call into the multi rather than from under the caller. */
+  multi->timer_overridden = true;
+  multi->timer_fn(multi, 0, multi->userdata);
+
   return 0;
 }
 
+int aur_login_async(aur_multi_t *multi, aur_t *aur, aur_done_fn done,
+    void *userdata) {
+  struct aur_request_t *req;
+  int r;
+
+  r = request_new(aur, &req);
+  if (r < 0)
+    return r;
+
+  return request_start(multi, req, login_begin(aur, req), done, userdata);
+}
+
+int aur_upload_async(aur_multi_t *multi, aur_t *aur, const char *tarball_path,
+    const char *category, aur_done_fn done, void *userdata) {
+  struct aur_request_t *req;
+  int r;
+
+  PROBE3(upload_start, aur, tarball_path, category);
+
+  r = request_new(aur, &req);
+  if (r < 0)
+    return r;
+
+  return request_start(multi, req,
+      upload_begin(aur, req, tarball_path, NULL, 0, category), done,
+      userdata);
+}
+
+int aur_upload_memory_async(aur_multi_t *multi, aur_t *aur,
+    const char *filename, const void *data, size_t len, const char *category,
+    aur_done_fn done, void *userdata) {
+  struct aur_request_t *req;
+  int r;
+
+  PROBE3(upload_start, aur, filename, category);
+
+  r = request_new(aur, &req);
+  if (r < 0)
+    return r;
+
+  return request_start(multi, req,
+      upload_begin(aur, req, filename, data, len, category), done, userdata);
+}
+
+int aur_logout_async(aur_multi_t *multi, aur_t *aur, aur_done_fn done,
+    void *userdata) {
+  struct aur_request_t *req;
+  int r;
+
+  r = request_new(aur, &req);
+  if (r < 0)
+    return r;
+
+  return request_start(multi, req, logout_begin(aur, req), done, userdata);
+}
+
 /* vim: set et ts=2 sw=2: */
@@ -2,22 +2,128 @@
 #define _AUR_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef struct aur_t aur_t;
 
+/* A reference counted set of DNS and TLS session caches which may be shared
+ * by clients living on different threads. Each client must still only be
+ * used by one thread at a time. With connections set, the share also pools
+ * open connections, which libcurl does not support between threads running
+ * at once: all clients of such a share must then be driven by a single
+ * thread, such as the one running their aur_multi_t. */
+typedef struct aur_share_t aur_share_t;
+
+enum {
+  AUR_PROTOCOL_AUR3,  /* multipart form uploads to /submit */
+  AUR_PROTOCOL_GIT,   /* git pushes over smart HTTP */
+};
+
 int aur_new(aur_t **ret, const char *domainname, bool secure);
 void aur_free(aur_t *aur);
 
+/* Creates a client with the settings, credentials, share and session of aur,
+ * so that a logged in account can upload on several clients at once. The
+ * copy does not read or write the cookie file. aur may be busy with an
+ * operation of its own. */
+int aur_dup(aur_t **ret, aur_t *aur);
+
+int aur_share_new(aur_share_t **ret, bool connections);
+aur_share_t *aur_share_ref(aur_share_t *share);
+void aur_share_unref(aur_share_t *share);
+
 int aur_set_username(aur_t *aur, const char *username);
 int aur_set_password(aur_t *aur, const char *password);
 int aur_set_cookiefile(aur_t *aur, const char *cookiefile);
+int aur_set_share(aur_t *aur, aur_share_t *share);
 int aur_set_debug(aur_t *aur, bool enable);
+int aur_set_protocol(aur_t *aur, int protocol);
+
+/* Timeouts are in seconds; passing 0 selects the built-in default. The total
+ * timeout defaults to a fixed limit for login and logout and scales with the
+ * tarball size for uploads. A request which hits a limit fails with:
+ *
+ *   -ETIMEDOUT   the connection could not be established in time
+ *   -ETIME       the request did not complete within the total timeout
+ *   -ECOMM       the transfer stalled below the low speed limit
+ */
+int aur_set_connect_timeout(aur_t *aur, long seconds);
+int aur_set_timeout(aur_t *aur, long seconds);
+int aur_set_lowspeed(aur_t *aur, long bytes_per_sec, long seconds);
+
+/* By default uploads are sent without waiting for the server's go-ahead. A
+ * non-zero timeout sends Expect: 100-continue and waits up to timeout_ms for
+ * the server to accept or refuse the body before sending it anyway. */
+int aur_set_expect_timeout(aur_t *aur, long timeout_ms);
+
+/* Before an upload with the aur3 protocol, recompress the tarball at the
+ * strongest gzip setting using all CPUs, but only when the upload speed
+ * measured on an earlier upload says the smaller file will arrive sooner
+ * despite the compression time. Clients with a share measure the speed
+ * together, and an upload expects its part of it alongside the uploads
+ * already running. */
+int aur_set_recompress(aur_t *aur, bool enable);
 
 int aur_login(aur_t *aur, char **error);
 int aur_logout(aur_t *aur);
+
+/* Looks up the current version of each package by pkgname with a single
+ * batched RPC query. Each element of versions receives a newly allocated
+ * version string, or NULL if the AUR does not know the package. */
+int aur_get_versions(aur_t *aur, const char *const *pkgnames, size_t count,
+    char **versions);
 int aur_upload(aur_t *aur, const char *tarball_path, const char *category,
     char **error);
 
+/* Uploads a compressed source tarball of len bytes held in memory, named
+ * filename. The buffer is streamed into the request as it is sent, so it
+ * must stay valid and unchanged until the upload completes. */
+int aur_upload_memory(aur_t *aur, const char *filename, const void *data,
+    size_t len, const char *category, char **error);
+
+/* Non-blocking interface. An aur_multi_t drives the transfers of any number
+ * of clients from the caller's event loop, one operation per client at a
+ * time. The loop watches the file descriptors and arms the single timer
+ * requested through the callbacks. Besides the sockets of the transfers, the
+ * descriptors include one signalled when work the multi moved to a thread,
+ * such as recompressing a tarball, has finished. The loop calls
+ * aur_multi_socket_action when a descriptor becomes ready, and
+ * aur_multi_timeout when the timer expires.
+ * Both return the number of operations still outstanding, or a negative
+ * errno. Completion is reported through the done callback with the same
+ * result the blocking call would return. The error text, if any, is only
+ * valid for the duration of the callback. */
+typedef struct aur_multi_t aur_multi_t;
+
+enum {
+  AUR_POLL_IN     = 1 << 0,
+  AUR_POLL_OUT    = 1 << 1,
+  AUR_POLL_REMOVE = 1 << 2,
+};
+
+typedef void (*aur_socket_fn)(aur_multi_t *multi, int fd, int events,
+    void *userdata);
+typedef void (*aur_timer_fn)(aur_multi_t *multi, long timeout_ms,
+    void *userdata);
+typedef void (*aur_done_fn)(aur_t *aur, int result, const char *error,
+    void *userdata);
+
+int aur_multi_new(aur_multi_t **ret, aur_socket_fn socket_fn,
+    aur_timer_fn timer_fn, void *userdata);
+void aur_multi_free(aur_multi_t *multi);
+int aur_multi_socket_action(aur_multi_t *multi, int fd, int events);
+int aur_multi_timeout(aur_multi_t *multi);
+
+int aur_login_async(aur_multi_t *multi, aur_t *aur, aur_done_fn done,
+    void *userdata);
+int aur_logout_async(aur_multi_t *multi, aur_t *aur, aur_done_fn done,
+    void *userdata);
+int aur_upload_async(aur_multi_t *multi, aur_t *aur, const char *tarball_path,
+    const char *category, aur_done_fn done, void *userdata);
+int aur_upload_memory_async(aur_multi_t *multi, aur_t *aur,
+    const char *filename, const void *data, size_t len, const char *category,
+    aur_done_fn done, void *userdata);
+
 /* vim: set et ts=2 sw=2: */
 
 #endif  /* _AUR_H */
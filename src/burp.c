@@ -1,15 +1,24 @@
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
 #include <termios.h>
+#include <time.h>
+#include <unistd.h>
 #include <wordexp.h>
 
 #include "aur.h"
+#include "journal.h"
 #include "log.h"
+#include "srcinfo.h"
+#include "tarball.h"
 #include "util.h"
 
 #ifdef GIT_VERSION
@@ -25,10 +34,66 @@ struct category_t {
   const char *id;
 };
 
+/* Credentials of one AUR account. The default account is described by the
+ * command line and the top of the config file; others come from [name]
+ * sections of the config file and are referred to by the manifest. */
+struct account_t {
+  char *name;
+  char *username;
+  char *password;
+  char *cookiefile;
+
+  aur_t *aur;
+  bool ready;
+  bool failed;
+
+  /* clients uploading in parallel; the first is aur, the others are copies
+   * of it sharing its session */
+  struct client_t *clients;
+  size_t client_count;
+};
+
+struct client_t {
+  aur_t *aur;
+  struct package_t *package;  /* in flight, or NULL when idle */
+};
+
+struct package_t {
+  char *path;
+  struct account_t *account;
+
+  /* the source archive of a package directory or of stdin, built in memory
+   * and uploaded as filename; NULL for tarballs on disk */
+  char *data;
+  size_t len;
+  char *filename;
+
+  /* with --dependency-order: the packages of the batch this one depends on,
+   * as indices into the list, and the wave it is uploaded in */
+  size_t *deps;
+  size_t dep_count;
+  size_t wave;
+  bool failed;
+};
+
 enum {
   OPT_DOMAIN = '~' + 1,
+  OPT_CONNECT_TIMEOUT,
+  OPT_TIMEOUT,
+  OPT_LOW_SPEED_TIME,
+  OPT_PROTOCOL,
+  OPT_SKIP_UNCHANGED,
+  OPT_JOURNAL,
+  OPT_RESUME,
+  OPT_MANIFEST,
+  OPT_RECOMPRESS,
+  OPT_DEPENDENCY_ORDER,
+  OPT_JOBS,
 };
 
+/* uploads running at once; more would only invite rate limiting */
+#define DEFAULT_JOBS 4
+
 /* This list must be sorted */
 /* TODO: move this list into aur.h, add aur_parse_category, etc */
 static const struct category_t categories[] = {
@@ -62,6 +127,22 @@ static char *arg_password;
 static char *arg_cookiefile;
 static int arg_loglevel = LOG_WARN;
 static bool arg_expire;
+static long arg_connect_timeout;
+static long arg_timeout;
+static long arg_lowspeed_time;
+static int arg_protocol = AUR_PROTOCOL_AUR3;
+static bool arg_skip_unchanged;
+static char *arg_journal;
+static bool arg_resume;
+static char *arg_manifest;
+static bool arg_recompress;
+static bool arg_dependency_order;
+static long arg_jobs = DEFAULT_JOBS;
+
+static struct account_t default_account;
+static struct account_t **accounts;
+static size_t account_count;
+static aur_share_t *share;
 
 static int category_compare(const void *a, const void *b) {
   const struct category_t *left = a;
@@ -79,6 +160,63 @@ static const char *category_validate(const char *cat) {
   return res ? res->id : NULL;
 }
 
+static int parse_seconds(const char *value, long *seconds) {
+  char *end;
+  long v;
+
+  if (value == NULL)
+    return -EINVAL;
+
+  errno = 0;
+  v = strtol(value, &end, 10);
+  if (errno != 0 || end == value || *end != '\0' || v < 0)
+    return -EINVAL;
+
+  *seconds = v;
+  return 0;
+}
+
+static int parse_jobs(const char *value, long *jobs) {
+  char *end;
+  long v;
+
+  if (value == NULL)
+    return -EINVAL;
+
+  errno = 0;
+  v = strtol(value, &end, 10);
+  if (errno != 0 || end == value || *end != '\0' || v < 1)
+    return -EINVAL;
+
+  *jobs = v;
+  return 0;
+}
+
+/* A key given without any value, as older config files do, means yes. */
+static int parse_bool(const char *value, bool *b) {
+  if (value == NULL || strcasecmp(value, "yes") == 0 ||
+      strcasecmp(value, "true") == 0 || streq(value, "1"))
+    *b = true;
+  else if (strcasecmp(value, "no") == 0 || strcasecmp(value, "false") == 0 ||
+      streq(value, "0"))
+    *b = false;
+  else
+    return -EINVAL;
+
+  return 0;
+}
+
+static int parse_protocol(const char *value, int *protocol) {
+  if (strcasecmp(value, "aur3") == 0)
+    *protocol = AUR_PROTOCOL_AUR3;
+  else if (strcasecmp(value, "git") == 0)
+    *protocol = AUR_PROTOCOL_GIT;
+  else
+    return -EINVAL;
+
+  return 0;
+}
+
 static char *find_config_file(void) {
   char *var, *out;
 
@@ -103,6 +241,30 @@ static char *find_config_file(void) {
   return NULL;
 }
 
+static char *find_journal_file(void) {
+  char *var, *out;
+
+  var = getenv("XDG_STATE_HOME");
+  if (var) {
+    if (asprintf(&out, "%s/burp/journal", var) < 0) {
+      log_error("failed to allocate memory");
+      return NULL;
+    }
+    return out;
+  }
+
+  var = getenv("HOME");
+  if (var) {
+    if (asprintf(&out, "%s/.local/state/burp/journal", var) < 0) {
+      log_error("failed to allocate memory");
+      return NULL;
+    }
+    return out;
+  }
+
+  return NULL;
+}
+
 static char *shell_expand(const char *in) {
   wordexp_t wexp;
   char *out = NULL;
@@ -144,8 +306,67 @@ static size_t strtrim(char *str) {
   return right - left;
 }
 
+static struct account_t *find_account(const char *name) {
+  for (size_t i = 0; i < account_count; ++i)
+    if (streq(accounts[i]->name, name))
+      return accounts[i];
+
+  return NULL;
+}
+
+static struct account_t *add_account(const char *name) {
+  struct account_t *account, **list;
+
+  account = find_account(name);
+  if (account)
+    return account;
+
+  account = calloc(1, sizeof(*account));
+  if (account == NULL)
+    return NULL;
+
+  account->name = strdup(name);
+  list = realloc(accounts, (account_count + 1) * sizeof(*list));
+  if (account->name == NULL || list == NULL) {
+    free(account->name);
+    free(account);
+    return NULL;
+  }
+
+  accounts = list;
+  accounts[account_count++] = account;
+
+  return account;
+}
+
+static void free_clients(struct account_t *account) {
+  for (size_t i = 1; i < account->client_count; ++i)
+    aur_free(account->clients[i].aur);
+  free(account->clients);
+}
+
+static void free_accounts(void) {
+  free_clients(&default_account);
+  aur_free(default_account.aur);
+
+  for (size_t i = 0; i < account_count; ++i) {
+    free_clients(accounts[i]);
+    aur_free(accounts[i]->aur);
+    if (accounts[i]->username != accounts[i]->name)
+      free(accounts[i]->username);
+    free(accounts[i]->password);
+    free(accounts[i]->cookiefile);
+    free(accounts[i]->name);
+    free(accounts[i]);
+  }
+  free(accounts);
+
+  aur_share_unref(share);
+}
+
 static int read_config_file(void) {
   _cleanup_fclose_ FILE *fp = NULL;
+  struct account_t *section = NULL;
   char *config_path = NULL;
   char line[BUFSIZ];
   int lineno = 0;
@@ -177,6 +398,21 @@ static int read_config_file(void) {
     if (len == 0 || line[0] == '#')
       continue;
 
+    if (line[0] == '[') {
+      if (len < 3 || line[len - 1] != ']') {
+        log_warn("invalid section '%s' on line %d", line, lineno);
+        continue;
+      }
+
+      line[len - 1] = '\0';
+      section = add_account(line + 1);
+      if (section == NULL) {
+        log_error("failed to allocate memory");
+        return -ENOMEM;
+      }
+      continue;
+    }
+
     key = value = line;
     strsep(&value, "=");
     strtrim(key);
@@ -186,20 +422,61 @@ static int read_config_file(void) {
       char *v = strdup(value);
       if (v == NULL)
         log_error("failed to allocate memory\n");
+      else if (section)
+        section->username = v;
       else
         arg_username = v;
     } else if (streq(key, "Password")) {
       char *v = strdup(value);
       if (v == NULL)
         log_error("failed to allocate memory\n");
+      else if (section)
+        section->password = v;
       else
         arg_password = v;
     } else if (streq(key, "Cookies")) {
       char *v = shell_expand(value);
       if (v == NULL)
         log_error("failed to allocate memory\n");
+      else if (section)
+        section->cookiefile = v;
       else
         arg_cookiefile = v;
+    } else if (section) {
+      log_warn("'%s' cannot be set per account on line %d", key, lineno);
+    } else if (streq(key, "ConnectTimeout")) {
+      if (parse_seconds(value, &arg_connect_timeout) < 0)
+        log_warn("invalid ConnectTimeout '%s' on line %d", value ? value : "",
+            lineno);
+    } else if (streq(key, "Timeout")) {
+      if (parse_seconds(value, &arg_timeout) < 0)
+        log_warn("invalid Timeout '%s' on line %d", value ? value : "",
+            lineno);
+    } else if (streq(key, "LowSpeedTime")) {
+      if (parse_seconds(value, &arg_lowspeed_time) < 0)
+        log_warn("invalid LowSpeedTime '%s' on line %d", value ? value : "",
+            lineno);
+    } else if (streq(key, "SkipUnchanged")) {
+      if (parse_bool(value, &arg_skip_unchanged) < 0)
+        log_warn("invalid SkipUnchanged '%s' on line %d", value, lineno);
+    } else if (streq(key, "Recompress")) {
+      if (parse_bool(value, &arg_recompress) < 0)
+        log_warn("invalid Recompress '%s' on line %d", value, lineno);
+    } else if (streq(key, "DependencyOrder")) {
+      if (parse_bool(value, &arg_dependency_order) < 0)
+        log_warn("invalid DependencyOrder '%s' on line %d", value, lineno);
+    } else if (streq(key, "Jobs")) {
+      if (parse_jobs(value, &arg_jobs) < 0)
+        log_warn("invalid Jobs '%s' on line %d", value ? value : "", lineno);
+    } else if (streq(key, "Journal")) {
+      char *v = shell_expand(value);
+      if (v == NULL)
+        log_error("failed to allocate memory\n");
+      else
+        arg_journal = v;
+    } else if (streq(key, "Protocol")) {
+      if (parse_protocol(value, &arg_protocol) < 0)
+        log_warn("invalid Protocol '%s' on line %d", value, lineno);
     } else
       log_warn("unknown config entry '%s' on line %d", key, lineno);
   }
@@ -235,6 +512,26 @@ static void __attribute__((noreturn)) print_usage(void) {
   /* "      --domain=DOMAIN       Domain of the AUR (default: aur.archlinux.org)\n" */
   "  -C FILE, --cookies=FILE   Read and write login cookies from FILE. \n"
   "                              The file must be a valid Netscape cookie file.\n"
+  "      --connect-timeout=SECS\n"
+  "                            Give up if a connection is not established\n"
+  "                              within SECS seconds.\n"
+  "      --timeout=SECS        Give up on any single request after SECS\n"
+  "                              seconds.\n"
+  "      --low-speed-time=SECS Give up if a transfer stalls for SECS seconds.\n"
+  "      --protocol=PROTO      Upload with PROTO, either 'aur3' (the default)\n"
+  "                              or 'git'.\n"
+  "      --skip-unchanged      Skip packages whose version is already in the\n"
+  "                              AUR.\n"
+  "      --journal=FILE        Record the outcome of each upload in FILE.\n"
+  "      --resume              Skip packages the journal records as uploaded\n"
+  "                              by an earlier, interrupted run.\n"
+  "      --manifest=FILE       Also upload the packages listed in FILE, one\n"
+  "                              'tarball [account]' pair per line.\n"
+  "      --recompress          Recompress tarballs before uploading when\n"
+  "                              the upload speed makes it worthwhile.\n"
+  "      --dependency-order    Upload packages after those of the batch they\n"
+  "                              depend on, and skip them if one fails.\n"
+  "      --jobs=N              Upload at most N packages at once (default: 4).\n"
   "  -v, --verbose             be more verbose. Pass twice for debug info.\n\n"
 
   "  -h, --help                display this help and exit\n"
@@ -254,6 +551,17 @@ static int parseargs(int *argc, char ***argv) {
     { "version",       no_argument,        0, 'V' },
     { "verbose",       no_argument,        0, 'v' },
     { "domain",        required_argument,  0, OPT_DOMAIN },
+    { "connect-timeout", required_argument, 0, OPT_CONNECT_TIMEOUT },
+    { "timeout",       required_argument,  0, OPT_TIMEOUT },
+    { "low-speed-time", required_argument, 0, OPT_LOW_SPEED_TIME },
+    { "protocol",      required_argument,  0, OPT_PROTOCOL },
+    { "skip-unchanged", no_argument,       0, OPT_SKIP_UNCHANGED },
+    { "journal",       required_argument,  0, OPT_JOURNAL },
+    { "resume",        no_argument,        0, OPT_RESUME },
+    { "manifest",      required_argument,  0, OPT_MANIFEST },
+    { "recompress",    no_argument,        0, OPT_RECOMPRESS },
+    { "dependency-order", no_argument,     0, OPT_DEPENDENCY_ORDER },
+    { "jobs",          required_argument,  0, OPT_JOBS },
     { NULL, 0, NULL, 0 },
   };
 
@@ -293,6 +601,54 @@ static int parseargs(int *argc, char ***argv) {
     case OPT_DOMAIN:
       arg_domain = optarg;
       break;
+    case OPT_CONNECT_TIMEOUT:
+      if (parse_seconds(optarg, &arg_connect_timeout) < 0) {
+        log_error("invalid connect timeout: %s", optarg);
+        return -EINVAL;
+      }
+      break;
+    case OPT_TIMEOUT:
+      if (parse_seconds(optarg, &arg_timeout) < 0) {
+        log_error("invalid timeout: %s", optarg);
+        return -EINVAL;
+      }
+      break;
+    case OPT_LOW_SPEED_TIME:
+      if (parse_seconds(optarg, &arg_lowspeed_time) < 0) {
+        log_error("invalid low speed time: %s", optarg);
+        return -EINVAL;
+      }
+      break;
+    case OPT_SKIP_UNCHANGED:
+      arg_skip_unchanged = true;
+      break;
+    case OPT_JOURNAL:
+      arg_journal = optarg;
+      break;
+    case OPT_RESUME:
+      arg_resume = true;
+      break;
+    case OPT_MANIFEST:
+      arg_manifest = optarg;
+      break;
+    case OPT_RECOMPRESS:
+      arg_recompress = true;
+      break;
+    case OPT_DEPENDENCY_ORDER:
+      arg_dependency_order = true;
+      break;
+    case OPT_JOBS:
+      if (parse_jobs(optarg, &arg_jobs) < 0) {
+        log_error("invalid number of jobs: %s", optarg);
+        return -EINVAL;
+      }
+      break;
+    case OPT_PROTOCOL:
+      if (parse_protocol(optarg, &arg_protocol) < 0) {
+        log_error("invalid protocol: %s", optarg);
+        return -EINVAL;
+      }
+      break;
     default:
       return -EINVAL;
     }
@@ -301,7 +657,7 @@ static int parseargs(int *argc, char ***argv) {
   *argv += optind;
   *argc -= optind;
 
-  if (!arg_expire && *argc == 0) {
+  if (!arg_expire && *argc == 0 && arg_manifest == NULL) {
     log_error("error: no files specified (use -h for help)");
     return -EINVAL;
   }
@@ -311,6 +667,19 @@ static int parseargs(int *argc, char ***argv) {
   return 0;
 }
 
+static const char *strerror_aur(int err) {
+  switch (err) {
+  case ETIMEDOUT:
+    return "timed out connecting to the AUR";
+  case ETIME:
+    return "request to the AUR timed out";
+  case ECOMM:
+    return "transfer to the AUR stalled";
+  default:
+    return strerror(err);
+  }
+}
+
 static int log_login_error(int err, const char *html_error) {
   if (html_error) {
     log_error("%s", html_error);
@@ -328,7 +697,7 @@ static int log_login_error(int err, const char *html_error) {
     log_error("login cookie not accepted.");
     break;
   default:
-    log_error("failed to login to AUR: %s", strerror(-err));
+    log_error("failed to login to AUR: %s", strerror_aur(-err));
     break;
   }
 
@@ -388,14 +757,14 @@ static char *ask_username(void) {
   return username;
 }
 
-static char *ask_password(void) {
+static char *ask_password(const char *username) {
   char *passwd, *r;
 
   passwd = malloc(128 + 1);
   if (passwd == NULL)
     return NULL;
 
-  printf("[%s] Enter password: ", arg_username);
+  printf("[%s] Enter password: ", username);
 
   r = read_stdin(passwd, 128, false);
   if (r == NULL) {
@@ -406,21 +775,23 @@ static char *ask_password(void) {
   return passwd;
 }
 
-static int login(aur_t *aur) {
+static int login(struct account_t *account) {
+  aur_t *aur = account->aur;
   int r;
-  _cleanup_free_ char *username = NULL, *password = NULL, *error = NULL;
-
-  if (arg_username == NULL) {
+  _cleanup_free_ char *password = NULL, *error = NULL;
 
-    username = ask_username();
+  if (account->username == NULL) {
+    char *username = ask_username();
     if (username == NULL)
       return log_login_error(ENOMEM, NULL);
 
     r = aur_set_username(aur, username);
-    if (r < 0)
+    if (r < 0) {
+      free(username);
       return log_login_error(r, NULL);
+    }
 
-    arg_username = username;
+    account->username = username;
   }
 
   r = aur_login(aur, &error);
@@ -431,7 +802,7 @@ static int login(aur_t *aur) {
       log_warn("Your cookie has expired -- using password login");
     /* fallthrough */
     case -ENOKEY:
-      password = ask_password();
+      password = ask_password(account->username);
       if (password == NULL)
         return -ENOMEM;
 
@@ -450,68 +821,1139 @@ static int login(aur_t *aur) {
   return 0;
 }
 
-static int upload(aur_t *aur, char **packages, int package_count) {
-  int r = 0;
+static int read_package_srcinfo(const struct package_t *package,
+    struct srcinfo_t *srcinfo) {
+  if (package->data)
+    return srcinfo_read_memory(srcinfo, package->data, package->len);
 
-  for (int i = 0; i < package_count; ++i) {
-    _cleanup_free_ char *error = NULL;
-    int k = aur_upload(aur, packages[i], arg_category, &error);
-    if (k == 0)
-      printf("success: uploaded %s\n", packages[i]);
-    else {
-      log_error("failed to upload %s: %s", packages[i],
-          error ? error : strerror(-k));
-      if (r == 0)
-        r = k;
+  return srcinfo_read_tarball(srcinfo, package->path);
+}
+
+/* Moves a package to the end of the kept part of the list. Dropped packages
+ * are swapped to the tail rather than overwritten so they can still be
+ * freed. */
+static void keep_package(struct package_t *packages, size_t *kept, size_t i) {
+  struct package_t package = packages[*kept];
+
+  packages[(*kept)++] = packages[i];
+  packages[i] = package;
+}
+
+/* Drops packages from the list whose version already matches the AUR, using
+ * one RPC query for the whole batch. Packages which can't be checked are
+ * left in place and uploaded as usual. */
+static void skip_unchanged(aur_t *aur, struct package_t *packages,
+    size_t *package_count) {
+  size_t count = *package_count, queried = 0, kept = 0;
+  _cleanup_free_ struct srcinfo_t *srcinfo = NULL;
+  _cleanup_free_ const char **pkgnames = NULL;
+  _cleanup_free_ char **versions = NULL;
+  _cleanup_free_ size_t *index = NULL;
+  _cleanup_free_ bool *skip = NULL;
+  int r;
+
+  srcinfo = calloc(count, sizeof(*srcinfo));
+  pkgnames = calloc(count, sizeof(*pkgnames));
+  versions = calloc(count, sizeof(*versions));
+  index = calloc(count, sizeof(*index));
+  skip = calloc(count, sizeof(*skip));
+  if (!srcinfo || !pkgnames || !versions || !index || !skip) {
+    log_warn("failed to allocate memory, not checking for unchanged packages");
+    return;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    r = read_package_srcinfo(&packages[i], &srcinfo[i]);
+    if (r < 0) {
+      log_warn("unable to read .SRCINFO from %s: %s", packages[i].path,
+          strerror(-r));
+      continue;
+    }
+
+    pkgnames[queried] = srcinfo[i].pkgnames[0];
+    index[queried++] = i;
+  }
+
+  r = queried ? aur_get_versions(aur, pkgnames, queried, versions) : 0;
+  if (r < 0)
+    log_warn("unable to check package versions in the AUR: %s",
+        strerror_aur(-r));
+
+  for (size_t j = 0; r == 0 && j < queried; ++j) {
+    const struct srcinfo_t *info = &srcinfo[index[j]];
+    _cleanup_free_ char *version = srcinfo_version(info);
+
+    if (version && versions[j] && streq(version, versions[j])) {
+      printf("skipping %s: %s %s is already in the AUR\n",
+          packages[index[j]].path, info->pkgbase, version);
+      skip[index[j]] = true;
+    }
+    free(versions[j]);
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    srcinfo_free(&srcinfo[i]);
+    if (!skip[i])
+      keep_package(packages, &kept, i);
+  }
+
+  *package_count = kept;
+}
+
+static int open_journal(struct journal_t *journal) {
+  _cleanup_free_ char *path = NULL;
+  int r;
+
+  if (arg_journal == NULL) {
+    path = find_journal_file();
+    if (path == NULL) {
+      log_warn("unable to determine location of journal. "
+          "Upload results will not be recorded.");
+      return 0;
+    }
+  }
+
+  r = journal_open(journal, arg_journal ? arg_journal : path);
+  if (r < 0) {
+    /* only a journal the user asked for is worth failing the run over */
+    if (arg_journal) {
+      log_error("failed to open journal %s: %s", arg_journal, strerror(-r));
+      return r;
+    }
+
+    log_warn("failed to open journal %s: %s. Upload results will not be "
+        "recorded%s.", path, strerror(-r),
+        arg_resume ? " and --resume has no effect" : "");
+  }
+
+  return 0;
+}
+
+/* Drops packages from the list which the journal records as uploaded with
+ * identical contents. */
+static void skip_journaled(struct journal_t *journal,
+    struct package_t *packages, size_t *package_count) {
+  size_t kept = 0;
+
+  for (size_t i = 0; i < *package_count; ++i) {
+    if (packages[i].data ?
+        journal_is_done_memory(journal, packages[i].path, packages[i].data,
+          packages[i].len) :
+        journal_is_done(journal, packages[i].path))
+      printf("skipping %s: already uploaded\n", packages[i].path);
+    else
+      keep_package(packages, &kept, i);
+  }
+
+  *package_count = kept;
+}
+
+static int add_package(struct package_t **packages, size_t *count,
+    const char *path, struct account_t *account) {
+  struct package_t *list;
+  char *p;
+
+  p = strdup(path);
+  if (p == NULL)
+    return -ENOMEM;
+
+  list = realloc(*packages, (*count + 1) * sizeof(*list));
+  if (list == NULL) {
+    free(p);
+    return -ENOMEM;
+  }
+
+  list[*count] = (struct package_t){ .path = p, .account = account };
+  *packages = list;
+  ++*count;
+
+  return 0;
+}
+
+static void free_packages(struct package_t *packages, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    free(packages[i].path);
+    free(packages[i].deps);
+    free(packages[i].data);
+    free(packages[i].filename);
+  }
+  free(packages);
+}
+
+/* Reads everything up to end of file into a newly allocated buffer. */
+static int read_fd(int fd, char **data, size_t *len) {
+  _cleanup_free_ char *buf = NULL;
+  size_t alloc = 0, n = 0;
+
+  for (;;) {
+    ssize_t k;
+
+    if (n == alloc) {
+      char *newbuf;
+
+      alloc = alloc ? alloc * 2 : BUFSIZ * 8;
+      newbuf = realloc(buf, alloc);
+      if (newbuf == NULL)
+        return -ENOMEM;
+      buf = newbuf;
+    }
+
+    k = read(fd, buf + n, alloc - n);
+    if (k < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
     }
+    if (k == 0)
+      break;
+    n += k;
+  }
+
+  *data = buf;
+  *len = n;
+  buf = NULL;
+
+  return 0;
+}
+
+static int set_archive(struct package_t *package,
+    const struct srcinfo_t *srcinfo, char *data, size_t len) {
+  _cleanup_free_ char *version = srcinfo_version(srcinfo);
+
+  if (version == NULL ||
+      asprintf(&package->filename, "%s-%s.src.tar.gz", srcinfo->pkgbase,
+        version) < 0)
+    return -ENOMEM;
+
+  package->data = data;
+  package->len = len;
+
+  return 0;
+}
+
+/* Adds a file of the package directory to the archive, under pkgbase/ as
+ * makepkg --source does. */
+static int archive_file(struct tar_writer_t *writer, const char *dir,
+    int dirfd, const char *pkgbase, const char *name) {
+  _cleanup_free_ char *data = NULL, *entry = NULL;
+  const char *base = strrchr(name, '/');
+  struct stat st;
+  size_t len;
+  int fd, r;
+
+  fd = openat(dirfd, name, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    r = -errno;
+  else {
+    if (fstat(fd, &st) < 0)
+      r = -errno;
+    else if (!S_ISREG(st.st_mode))
+      r = -EINVAL;
+    else
+      r = read_fd(fd, &data, &len);
+    close(fd);
+  }
+
+  if (r < 0) {
+    log_error("failed to read %s/%s: %s", dir, name, strerror(-r));
+    return r;
   }
 
+  if (asprintf(&entry, "%s/%s", pkgbase, base ? base + 1 : name) < 0)
+    return -ENOMEM;
+
+  r = tar_writer_add(writer, entry, '0', st.st_mode, st.st_mtime, data, len);
+  if (r < 0)
+    log_error("failed to add %s to the archive: %s", entry, strerror(-r));
+
   return r;
 }
 
-static int create_aur_client(aur_t **aur) {
+static bool archived(const struct srcinfo_t *srcinfo, size_t i) {
+  const char *name = srcinfo->files[i];
+
+  if (streq(name, "PKGBUILD") || streq(name, ".SRCINFO"))
+    return true;
+
+  for (size_t j = 0; j < i; ++j)
+    if (streq(srcinfo->files[j], name))
+      return true;
+
+  return false;
+}
+
+static int write_directory_archive(struct tar_writer_t *writer,
+    const char *dir, int dirfd, const struct srcinfo_t *srcinfo) {
+  _cleanup_free_ char *root = NULL;
+  struct stat st;
   int r;
 
-  r = aur_new(aur, arg_domain, true);
+  if (fstat(dirfd, &st) < 0)
+    return -errno;
+
+  if (asprintf(&root, "%s/", srcinfo->pkgbase) < 0)
+    return -ENOMEM;
+
+  r = tar_writer_add(writer, root, '5', 0755, st.st_mtime, NULL, 0);
+  if (r == 0)
+    r = archive_file(writer, dir, dirfd, srcinfo->pkgbase, "PKGBUILD");
+  if (r == 0)
+    r = archive_file(writer, dir, dirfd, srcinfo->pkgbase, ".SRCINFO");
+
+  for (size_t i = 0; r == 0 && i < srcinfo->file_count; ++i)
+    if (!archived(srcinfo, i))
+      r = archive_file(writer, dir, dirfd, srcinfo->pkgbase,
+          srcinfo->files[i]);
+
+  return r;
+}
+
+/* Builds the source archive of a package directory in memory instead of
+ * having makepkg --source write it to disk for us to read back. The
+ * .SRCINFO names the local files to include. */
+static int build_directory_archive(struct package_t *package) {
+  _cleanup_tar_writer_ struct tar_writer_t writer = {};
+  _cleanup_srcinfo_ struct srcinfo_t srcinfo = {};
+  _cleanup_free_ char *text = NULL, *data = NULL;
+  size_t len;
+  int dirfd, fd, r;
+
+  dirfd = open(package->path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (dirfd < 0) {
+    log_error("failed to open %s: %s", package->path, strerror(errno));
+    return -errno;
+  }
+
+  fd = openat(dirfd, ".SRCINFO", O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    r = -errno;
+  else {
+    r = read_fd(fd, &text, &len);
+    close(fd);
+  }
+
+  if (r == 0)
+    r = srcinfo_parse(&srcinfo, text, len);
   if (r < 0) {
-    log_error("failed to create AUR client: %s", strerror(-r));
+    log_error("failed to read %s/.SRCINFO: %s", package->path, strerror(-r));
+    if (r == -ENOENT)
+      log_error("generate it with: makepkg --printsrcinfo > .SRCINFO");
+    close(dirfd);
     return r;
   }
 
-  if (arg_username)
-    aur_set_username(*aur, arg_username);
-  if (arg_password)
-    aur_set_password(*aur, arg_password);
-  if (arg_cookiefile)
-    aur_set_cookiefile(*aur, arg_cookiefile);
-  if (arg_loglevel >= LOG_DEBUG)
-    aur_set_debug(*aur, true);
+  r = tar_writer_init(&writer);
+  if (r == 0)
+    r = write_directory_archive(&writer, package->path, dirfd, &srcinfo);
+  close(dirfd);
+  if (r == 0)
+    r = tar_writer_finish(&writer, &data, &len);
+  if (r == 0)
+    r = set_archive(package, &srcinfo, data, len);
+  if (r < 0) {
+    log_error("failed to build source archive of %s: %s", package->path,
+        strerror(-r));
+    return r;
+  }
+
+  log_info("built %s from %s (%zu bytes)", package->filename, package->path,
+      len);
+  data = NULL;
 
   return 0;
 }
 
-int main(int argc, char *argv[]) {
-  _cleanup_aur_ aur_t *aur = NULL;
+/* Reads a source archive, compressed or not, from stdin. The package is
+ * then known by the file name makepkg would have given the archive. */
+static int read_stdin_archive(struct package_t *package) {
+  _cleanup_srcinfo_ struct srcinfo_t srcinfo = {};
+  _cleanup_free_ char *data = NULL;
+  size_t len;
+  int r;
 
-  if (read_config_file() < 0)
-    return EXIT_FAILURE;
+  if (isatty(STDIN_FILENO)) {
+    log_error("refusing to read a tarball from a terminal");
+    return -EINVAL;
+  }
 
-  if (parseargs(&argc, &argv) < 0)
-    return EXIT_FAILURE;
+  r = read_fd(STDIN_FILENO, &data, &len);
+  if (r < 0) {
+    log_error("failed to read stdin: %s", strerror(-r));
+    return r;
+  }
 
-  if (create_aur_client(&aur) < 0)
-    return EXIT_FAILURE;
+  r = srcinfo_read_memory(&srcinfo, data, len);
+  if (r < 0) {
+    log_error("failed to read .SRCINFO from stdin: %s", strerror(-r));
+    return r;
+  }
 
-  if (arg_expire)
-    return !!aur_logout(aur);
+  if (!tarball_is_gzip(data, len)) {
+    char *compressed;
 
-  if (login(aur) < 0)
-    return EXIT_FAILURE;
+    r = tarball_gzip(data, len, &compressed, &len);
+    if (r < 0) {
+      log_error("failed to compress the tarball from stdin: %s",
+          strerror(-r));
+      return r;
+    }
 
-  if (upload(aur, argv, argc) < 0)
-    return EXIT_FAILURE;
+    free(data);
+    data = compressed;
+  }
+
+  r = set_archive(package, &srcinfo, data, len);
+  if (r == 0) {
+    data = NULL;
+    free(package->path);
+    package->path = strdup(package->filename);
+    if (package->path == NULL)
+      r = -ENOMEM;
+  }
+  if (r < 0) {
+    log_error("failed to allocate memory");
+    return r;
+  }
+
+  return 0;
+}
+
+/* Replaces package directories and "-" in the list with source archives
+ * built in memory. */
+static int build_archives(struct package_t *packages, size_t count) {
+  bool read_stdin = false;
+  struct stat st;
+  int r;
+
+  for (size_t i = 0; i < count; ++i) {
+    struct package_t *package = &packages[i];
+
+    if (streq(package->path, "-")) {
+      if (read_stdin) {
+        log_error("only one tarball can be read from stdin");
+        return -EINVAL;
+      }
+      read_stdin = true;
+
+      r = read_stdin_archive(package);
+      if (r < 0)
+        return r;
+    } else if (stat(package->path, &st) == 0 && S_ISDIR(st.st_mode)) {
+      r = build_directory_archive(package);
+      if (r < 0)
+        return r;
+    }
+  }
+
+  return 0;
+}
+
+/* Reads "tarball [account]" lines from the manifest. Packages without an
+ * account are uploaded with the default one. */
+static int read_manifest(const char *path, struct package_t **packages,
+    size_t *count) {
+  _cleanup_fclose_ FILE *fp = NULL;
+  char line[BUFSIZ];
+  int lineno = 0, r;
+
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    log_error("failed to open %s: %s", path, strerror(errno));
+    return -errno;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    struct account_t *account = &default_account;
+    char *tarball, *name, *p = line;
+
+    ++lineno;
+
+    if (strtrim(line) == 0 || line[0] == '#')
+      continue;
+
+    tarball = strsep(&p, " \t");
+    name = p ? p + strspn(p, " \t") : NULL;
+    if (name && *name) {
+      account = find_account(name);
+      if (account == NULL) {
+        log_error("unknown account '%s' on line %d of %s", name, lineno,
+            path);
+        return -EINVAL;
+      }
+    }
+
+    r = add_package(packages, count, tarball, account);
+    if (r < 0) {
+      log_error("failed to allocate memory");
+      return r;
+    }
+  }
+
+  return 0;
+}
+
+static int collect_packages(int argc, char **argv,
+    struct package_t **packages, size_t *count) {
+  int r;
+
+  for (int i = 0; i < argc; ++i) {
+    r = add_package(packages, count, argv[i], &default_account);
+    if (r < 0) {
+      log_error("failed to allocate memory");
+      return r;
+    }
+  }
+
+  if (arg_manifest) {
+    r = read_manifest(arg_manifest, packages, count);
+    if (r < 0)
+      return r;
+  }
+
+  return build_archives(*packages, *count);
+}
+
+static int create_aur_client(struct account_t *account) {
+  aur_t *aur;
+  int r;
+
+  if (account->aur)
+    return 0;
+
+  /* clients of all accounts share DNS, connection and TLS session caches;
+   * they all run on this thread, so sharing connections is safe */
+  if (share == NULL) {
+    r = aur_share_new(&share, true);
+    if (r < 0)
+      log_warn("failed to create shared connection cache: %s", strerror(-r));
+  }
+
+  r = aur_new(&aur, arg_domain, true);
+  if (r < 0) {
+    log_error("failed to create AUR client: %s", strerror(-r));
+    return r;
+  }
+
+  /* an account section without a User logs in as its own name */
+  if (account->username == NULL)
+    account->username = account->name;
+
+  if (account->username)
+    aur_set_username(aur, account->username);
+  if (account->password)
+    aur_set_password(aur, account->password);
+  if (account->cookiefile)
+    aur_set_cookiefile(aur, account->cookiefile);
+  if (arg_loglevel >= LOG_DEBUG)
+    aur_set_debug(aur, true);
+
+  aur_set_connect_timeout(aur, arg_connect_timeout);
+  aur_set_timeout(aur, arg_timeout);
+  aur_set_lowspeed(aur, 0, arg_lowspeed_time);
+  aur_set_protocol(aur, arg_protocol);
+  aur_set_recompress(aur, arg_recompress);
+  aur_set_share(aur, share);
+
+  account->aur = aur;
+
+  return 0;
+}
+
+static int expire(void) {
+  int r;
+
+  r = create_aur_client(&default_account);
+  if (r < 0)
+    return r;
+
+  r = aur_logout(default_account.aur);
+
+  for (size_t i = 0; i < account_count; ++i) {
+    int k = create_aur_client(accounts[i]);
+    if (k == 0)
+      k = aur_logout(accounts[i]->aur);
+    if (k < 0 && r == 0)
+      r = k;
+  }
+
+  return r;
+}
+
+/* Logs in every account with packages in the batch. This happens one account
+ * at a time before any upload starts, since each may prompt for a password.
+ * Packages of an account which fails to log in are not uploaded, and only
+ * when no account succeeds is the error returned. */
+static int login_accounts(struct package_t *packages, size_t count) {
+  bool ready = false;
+  int r = 0;
+
+  for (size_t i = 0; i < count; ++i) {
+    struct account_t *account = packages[i].account;
+    int k;
+
+    if (account->ready || account->failed)
+      continue;
+
+    k = create_aur_client(account);
+    if (k == 0)
+      k = login(account);
+
+    if (k < 0) {
+      account->failed = true;
+      if (r == 0)
+        r = k;
+    } else
+      ready = account->ready = true;
+  }
+
+  return ready ? 0 : r;
+}
+
+struct pkgname_t {
+  const char *name;
+  size_t package;
+};
+
+static int pkgname_compare(const void *a, const void *b) {
+  return strcmp(((const struct pkgname_t *)a)->name,
+      ((const struct pkgname_t *)b)->name);
+}
+
+static int add_dependency(struct package_t *package, size_t dep) {
+  size_t *deps;
+
+  for (size_t i = 0; i < package->dep_count; ++i)
+    if (package->deps[i] == dep)
+      return 0;
+
+  deps = realloc(package->deps, (package->dep_count + 1) * sizeof(*deps));
+  if (deps == NULL)
+    return -ENOMEM;
+
+  deps[package->dep_count++] = dep;
+  package->deps = deps;
+
+  return 0;
+}
+
+/* Links each package to the packages of the batch named by the depends and
+ * makedepends of its .SRCINFO. */
+static int find_dependencies(struct package_t *packages, size_t count,
+    struct srcinfo_t *srcinfo) {
+  _cleanup_free_ struct pkgname_t *names = NULL;
+  size_t name_count = 0;
+  int r;
+
+  for (size_t i = 0; i < count; ++i)
+    name_count += srcinfo[i].pkgname_count;
+
+  names = calloc(name_count + 1, sizeof(*names));
+  if (names == NULL)
+    return -ENOMEM;
+
+  name_count = 0;
+  for (size_t i = 0; i < count; ++i)
+    for (size_t j = 0; j < srcinfo[i].pkgname_count; ++j)
+      names[name_count++] = (struct pkgname_t){ srcinfo[i].pkgnames[j], i };
+
+  qsort(names, name_count, sizeof(*names), pkgname_compare);
+
+  for (size_t i = 0; i < count; ++i) {
+    for (size_t j = 0; j < srcinfo[i].depend_count; ++j) {
+      struct pkgname_t key = { srcinfo[i].depends[j], 0 }, *match;
+
+      match = bsearch(&key, names, name_count, sizeof(*names),
+          pkgname_compare);
+      /* split packages depending on each other need no ordering */
+      if (match == NULL || match->package == i)
+        continue;
+
+      r = add_dependency(&packages[i], match->package);
+      if (r < 0)
+        return r;
+    }
+  }
+
+  return 0;
+}
+
+/* Whether the package at start depends on itself through packages which
+ * have no wave yet. stack and seen have room for count elements. */
+static bool in_cycle(const struct package_t *packages, size_t count,
+    size_t start, size_t *stack, bool *seen) {
+  size_t top = 0;
+
+  memset(seen, 0, count * sizeof(*seen));
+  stack[top++] = start;
+
+  while (top > 0) {
+    const struct package_t *package = &packages[stack[--top]];
+
+    for (size_t d = 0; d < package->dep_count; ++d) {
+      size_t dep = package->deps[d];
+
+      if (dep == start)
+        return true;
+      if (seen[dep] || packages[dep].wave != SIZE_MAX)
+        continue;
+
+      seen[dep] = true;
+      stack[top++] = dep;
+    }
+  }
+
+  return false;
+}
+
+/* Splits the batch into waves for --dependency-order. The first wave holds
+ * the packages which depend on nothing else in the batch, and each further
+ * wave those whose dependencies are all in earlier waves. When no package can
+ * be placed, the packages depending on each other in a cycle go together in
+ * the next wave, and those depending on them follow in later ones. */
+static int plan_waves(struct package_t *packages, size_t count,
+    size_t *wave_count) {
+  _cleanup_free_ struct srcinfo_t *srcinfo = NULL;
+  _cleanup_free_ size_t *stack = NULL;
+  _cleanup_free_ bool *seen = NULL, *cyclic = NULL;
+  size_t placed = 0, wave = 0;
+  int r;
+
+  srcinfo = calloc(count, sizeof(*srcinfo));
+  stack = calloc(count, sizeof(*stack));
+  seen = calloc(count, sizeof(*seen));
+  cyclic = calloc(count, sizeof(*cyclic));
+  if (srcinfo == NULL || stack == NULL || seen == NULL || cyclic == NULL)
+    return -ENOMEM;
+
+  for (size_t i = 0; i < count; ++i) {
+    r = read_package_srcinfo(&packages[i], &srcinfo[i]);
+    if (r < 0)
+      log_warn("unable to read .SRCINFO from %s, "
+          "uploading it without regard to dependencies: %s",
+          packages[i].path, strerror(-r));
+  }
+
+  r = find_dependencies(packages, count, srcinfo);
+
+  for (size_t i = 0; i < count; ++i) {
+    srcinfo_free(&srcinfo[i]);
+    packages[i].wave = SIZE_MAX;
+  }
+
+  if (r < 0)
+    return r;
+
+  while (placed < count) {
+    size_t placed_before = placed;
+
+    for (size_t i = 0; i < count; ++i) {
+      struct package_t *package = &packages[i];
+      size_t d;
+
+      if (package->wave != SIZE_MAX)
+        continue;
+
+      for (d = 0; d < package->dep_count; ++d)
+        if (packages[package->deps[d]].wave >= wave)
+          break;
+
+      if (d == package->dep_count) {
+        package->wave = wave;
+        ++placed;
+      }
+    }
+
+    /* Every package left depends on another one left, so following the
+     * dependencies must lead into a cycle. Cycles are found before any is
+     * placed, so that a package merely depending on one is not taken for a
+     * member. */
+    if (placed == placed_before) {
+      for (size_t i = 0; i < count; ++i)
+        cyclic[i] = packages[i].wave == SIZE_MAX &&
+          in_cycle(packages, count, i, stack, seen);
+
+      for (size_t i = 0; i < count; ++i) {
+        if (!cyclic[i])
+          continue;
+        log_warn("%s is part of a dependency cycle, uploading it together "
+            "with the rest of the cycle", packages[i].path);
+        packages[i].wave = wave;
+        ++placed;
+      }
+    }
+
+    ++wave;
+  }
+
+  for (size_t i = 0; i < count; ++i)
+    log_info("wave %zu: %s", packages[i].wave + 1, packages[i].path);
+
+  *wave_count = wave;
+  return 0;
+}
+
+static struct package_t *failed_dependency(struct package_t *packages,
+    const struct package_t *package) {
+  for (size_t i = 0; i < package->dep_count; ++i)
+    if (packages[package->deps[i]].failed)
+      return &packages[package->deps[i]];
+
+  return NULL;
+}
+
+/* A set of uploads driven concurrently through one aur_multi_t: one upload
+ * in flight per account, each account working through its packages of the
+ * current wave in the order given. */
+struct batch_t {
+  aur_multi_t *multi;
+  int epfd;
+  long long deadline;
+
+  struct package_t *packages;
+  size_t count;
+  size_t wave;
+
+  /* the next package of the wave to start, and the uploads running */
+  size_t next;
+  long running;
+
+  struct journal_t *journal;
+  int result;
+};
+
+static long long now_msec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void batch_socket(aur_multi_t *multi, int fd, int events,
+    void *userdata) {
+  struct batch_t *batch = userdata;
+  struct epoll_event ev = { .data.fd = fd };
+
+  if (events & AUR_POLL_REMOVE) {
+    epoll_ctl(batch->epfd, EPOLL_CTL_DEL, fd, NULL);
+    return;
+  }
+
+  if (events & AUR_POLL_IN)
+    ev.events |= EPOLLIN;
+  if (events & AUR_POLL_OUT)
+    ev.events |= EPOLLOUT;
+
+  if (epoll_ctl(batch->epfd, EPOLL_CTL_MOD, fd, &ev) < 0 && errno == ENOENT)
+    epoll_ctl(batch->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void batch_timer(aur_multi_t *multi, long timeout_ms, void *userdata) {
+  struct batch_t *batch = userdata;
+
+  batch->deadline = timeout_ms < 0 ? -1 : now_msec() + timeout_ms;
+}
+
+static void batch_report(struct batch_t *batch, struct package_t *package,
+    int result, const char *error) {
+  const char *name = package->account->name;
+
+  if (result == 0) {
+    if (name)
+      printf("success: uploaded %s as %s\n", package->path, name);
+    else
+      printf("success: uploaded %s\n", package->path);
+  } else {
+    log_error("failed to upload %s: %s", package->path,
+        error ? error : strerror_aur(-result));
+    package->failed = true;
+    if (batch->result == 0)
+      batch->result = result;
+  }
+
+  if (batch->journal->fd >= 0) {
+    int r = package->data ?
+        journal_record_memory(batch->journal, package->path, package->data,
+          package->len, result == 0) :
+        journal_record(batch->journal, package->path, result == 0);
+    if (r < 0 && r != -ENOENT)
+      log_warn("failed to record %s in journal: %s", package->path,
+          strerror(-r));
+  }
+}
+
+/* Finds an idle client of the account, adding a copy of its logged in
+ * client to the pool if all are busy. With at most --jobs uploads running,
+ * the pool never grows past that. */
+static int account_client(struct account_t *account,
+    struct client_t **ret) {
+  struct client_t *clients;
+  aur_t *aur = account->aur;
+  int r;
+
+  for (size_t i = 0; i < account->client_count; ++i)
+    if (account->clients[i].package == NULL) {
+      *ret = &account->clients[i];
+      return 0;
+    }
+
+  if (account->client_count > 0) {
+    r = aur_dup(&aur, account->aur);
+    if (r < 0)
+      return r;
+  }
+
+  clients = realloc(account->clients,
+      (account->client_count + 1) * sizeof(*clients));
+  if (clients == NULL) {
+    if (aur != account->aur)
+      aur_free(aur);
+    return -ENOMEM;
+  }
+
+  account->clients = clients;
+  clients[account->client_count] = (struct client_t){ .aur = aur };
+  *ret = &clients[account->client_count++];
+
+  return 0;
+}
+
+static void batch_done(aur_t *aur, int result, const char *error,
+    void *userdata);
+
+/* Starts the upload of a package on an idle client of its account. Returns
+ * false if the upload could not be started. */
+static bool batch_start(struct batch_t *batch, struct package_t *package) {
+  struct client_t *client;
+  int r;
+
+  r = account_client(package->account, &client);
+  if (r < 0) {
+    log_error("failed to create AUR client: %s", strerror(-r));
+    batch_report(batch, package, r, NULL);
+    return false;
+  }
+
+  if (package->data)
+    r = aur_upload_memory_async(batch->multi, client->aur, package->filename,
+        package->data, package->len, arg_category, batch_done, batch);
+  else
+    r = aur_upload_async(batch->multi, client->aur, package->path,
+        arg_category, batch_done, batch);
+  if (r < 0) {
+    batch_report(batch, package, r, NULL);
+    return false;
+  }
+
+  client->package = package;
+  return true;
+}
+
+static struct client_t *find_client(aur_t *aur) {
+  struct account_t *account = &default_account;
+
+  for (size_t i = 0; i <= account_count; ++i) {
+    if (i > 0)
+      account = accounts[i - 1];
+
+    for (size_t j = 0; j < account->client_count; ++j)
+      if (account->clients[j].aur == aur)
+        return &account->clients[j];
+  }
+
+  return NULL;
+}
+
+/* Starts the queued packages of the wave until --jobs uploads are running
+ * or none are left. */
+static void batch_fill(struct batch_t *batch) {
+  while (batch->running < arg_jobs && batch->next < batch->count) {
+    struct package_t *package = &batch->packages[batch->next++];
+    struct package_t *dep;
+
+    if (package->wave != batch->wave)
+      continue;
+
+    if (package->account->failed) {
+      log_error("not uploading %s: not logged in", package->path);
+      package->failed = true;
+      if (batch->result == 0)
+        batch->result = -EACCES;
+      continue;
+    }
+
+    dep = failed_dependency(batch->packages, package);
+    if (dep) {
+      log_error("not uploading %s: it depends on %s, which was not uploaded",
+          package->path, dep->path);
+      package->failed = true;
+      if (batch->result == 0)
+        batch->result = -ECANCELED;
+      continue;
+    }
+
+    if (batch_start(batch, package))
+      ++batch->running;
+  }
+}
+
+static void batch_done(aur_t *aur, int result, const char *error,
+    void *userdata) {
+  struct batch_t *batch = userdata;
+  struct client_t *client = find_client(aur);
+  struct package_t *package = client->package;
+
+  client->package = NULL;
+  --batch->running;
+  batch_report(batch, package, result, error);
+  batch_fill(batch);
+}
+
+/* Uploads the packages of the current wave, up to --jobs at a time. Failed
+ * uploads are recorded in the batch; only errors which stop all uploads are
+ * returned. */
+static int batch_run(struct batch_t *batch) {
+  int pending;
+
+  batch->next = 0;
+  batch_fill(batch);
+  pending = batch->running;
+
+  while (pending > 0) {
+    struct epoll_event events[16];
+    int timeout = -1, n;
+
+    if (batch->deadline >= 0) {
+      long long left = batch->deadline - now_msec();
+      timeout = left > 0 ? (int)left : 0;
+    }
+
+    n = epoll_wait(batch->epfd, events, ARRAYSIZE(events), timeout);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      log_error("failed to wait for uploads: %s", strerror(errno));
+      return -errno;
+    }
+
+    for (int i = 0; i < n; ++i) {
+      int flags = 0;
+
+      if (events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+        flags |= AUR_POLL_IN;
+      if (events[i].events & EPOLLOUT)
+        flags |= AUR_POLL_OUT;
+
+      pending = aur_multi_socket_action(batch->multi, events[i].data.fd,
+          flags);
+    }
+
+    if (batch->deadline >= 0 && now_msec() >= batch->deadline) {
+      batch->deadline = -1;
+      pending = aur_multi_timeout(batch->multi);
+    }
+
+    if (pending < 0) {
+      log_error("failed to drive uploads: %s", strerror(-pending));
+      return pending;
+    }
+  }
+
+  return 0;
+}
+
+static int upload(struct journal_t *journal, struct package_t *packages,
+    size_t count) {
+  struct batch_t batch = {
+    .epfd = -1,
+    .deadline = -1,
+    .packages = packages,
+    .count = count,
+    .journal = journal,
+  };
+  size_t waves = 1;
+  int r;
+
+  if (arg_resume) {
+    skip_journaled(journal, packages, &count);
+    if (count == 0)
+      return 0;
+  }
+
+  if (arg_skip_unchanged) {
+    r = create_aur_client(&default_account);
+    if (r < 0)
+      return r;
+
+    skip_unchanged(default_account.aur, packages, &count);
+    if (count == 0)
+      return 0;
+  }
+  batch.count = count;
+
+  if (arg_dependency_order) {
+    r = plan_waves(packages, count, &waves);
+    if (r < 0) {
+      log_error("failed to order packages by dependencies: %s", strerror(-r));
+      return r;
+    }
+  }
+
+  r = login_accounts(packages, count);
+  if (r < 0)
+    return r;
+
+  batch.epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (batch.epfd < 0) {
+    log_error("failed to create epoll instance: %s", strerror(errno));
+    return -errno;
+  }
+
+  r = aur_multi_new(&batch.multi, batch_socket, batch_timer, &batch);
+  if (r < 0) {
+    log_error("failed to start uploads: %s", strerror(-r));
+    close(batch.epfd);
+    return r;
+  }
+
+  for (batch.wave = 0; r == 0 && batch.wave < waves; ++batch.wave)
+    r = batch_run(&batch);
+
+  aur_multi_free(batch.multi);
+  close(batch.epfd);
+
+  return r < 0 ? r : batch.result;
+}
+
+int main(int argc, char *argv[]) {
+  _cleanup_journal_ struct journal_t journal = { .fd = -1 };
+  struct package_t *packages = NULL;
+  size_t count = 0;
+  int r;
+
+  if (read_config_file() < 0)
+    return EXIT_FAILURE;
+
+  if (parseargs(&argc, &argv) < 0)
+    return EXIT_FAILURE;
+
+  default_account.username = arg_username;
+  default_account.password = arg_password;
+  default_account.cookiefile = arg_cookiefile;
+
+  if (arg_expire)
+    r = expire();
+  else {
+    r = collect_packages(argc, argv, &packages, &count);
+    if (r == 0)
+      r = open_journal(&journal);
+    if (r == 0)
+      r = upload(&journal, packages, count);
+  }
+
+  free_packages(packages, count);
+  free_accounts();
 
-  return EXIT_SUCCESS;
+  return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 /* vim: set et ts=2 sw=2: */
@@ -0,0 +1,466 @@
+#include "git.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <zlib.h>
+
+#include "util.h"
+
+#define PACK_HEADER_SIZE 12
+
+struct tree_item_t {
+  char *name;
+  bool is_dir;
+  const struct tar_entry_t *entry;
+  const char *mode;
+  unsigned char id[SHA1_DIGEST_LENGTH];
+};
+
+static const char *object_type_name(int type) {
+  switch (type) {
+  case GIT_OBJ_COMMIT:
+    return "commit";
+  case GIT_OBJ_TREE:
+    return "tree";
+  case GIT_OBJ_BLOB:
+  default:
+    return "blob";
+  }
+}
+
+static int pack_reserve(struct git_pack_t *pack, size_t len) {
+  size_t alloc = pack->alloc ? pack->alloc : 4096;
+  char *data;
+
+  if (pack->len + len <= pack->alloc)
+    return 0;
+
+  while (alloc < pack->len + len)
+    alloc *= 2;
+
+  data = realloc(pack->data, alloc);
+  if (data == NULL)
+    return -ENOMEM;
+
+  pack->data = data;
+  pack->alloc = alloc;
+
+  return 0;
+}
+
+int git_pack_init(struct git_pack_t *pack) {
+  memset(pack, 0, sizeof(*pack));
+
+  /* the object count is filled in by git_pack_finish */
+  if (pack_reserve(pack, PACK_HEADER_SIZE) < 0)
+    return -ENOMEM;
+
+  memcpy(pack->data, "PACK\0\0\0\2\0\0\0\0", PACK_HEADER_SIZE);
+  pack->len = PACK_HEADER_SIZE;
+
+  return 0;
+}
+
+void git_pack_free(struct git_pack_t *pack) {
+  free(pack->data);
+  memset(pack, 0, sizeof(*pack));
+}
+
+int git_pack_add(struct git_pack_t *pack, int type, const void *data,
+    size_t len, unsigned char id[SHA1_DIGEST_LENGTH]) {
+  char header[64];
+  struct sha1_t sha;
+  unsigned char *p;
+  uLongf zlen;
+  size_t size = len;
+  int r;
+
+  r = snprintf(header, sizeof(header), "%s %zu", object_type_name(type), len);
+  sha1_init(&sha);
+  sha1_update(&sha, header, r + 1);
+  sha1_update(&sha, data, len);
+  sha1_final(&sha, id);
+
+  zlen = compressBound(len);
+  if (pack_reserve(pack, 16 + zlen) < 0)
+    return -ENOMEM;
+
+  /* object header: type and size as a little endian varint */
+  p = (unsigned char *)pack->data + pack->len;
+  *p = type << 4 | (size & 0x0f);
+  size >>= 4;
+  while (size) {
+    *p++ |= 0x80;
+    *p = size & 0x7f;
+    size >>= 7;
+  }
+  p++;
+
+  if (compress2(p, &zlen, data, len, Z_DEFAULT_COMPRESSION) != Z_OK)
+    return -ENOMEM;
+
+  pack->len = (char *)p - pack->data + zlen;
+  pack->count++;
+
+  return 0;
+}
+
+int git_pack_finish(struct git_pack_t *pack) {
+  struct sha1_t sha;
+
+  if (pack_reserve(pack, SHA1_DIGEST_LENGTH) < 0)
+    return -ENOMEM;
+
+  pack->data[8] = pack->count >> 24;
+  pack->data[9] = pack->count >> 16;
+  pack->data[10] = pack->count >> 8;
+  pack->data[11] = pack->count;
+
+  sha1_init(&sha);
+  sha1_update(&sha, pack->data, pack->len);
+  sha1_final(&sha, (unsigned char *)pack->data + pack->len);
+  pack->len += SHA1_DIGEST_LENGTH;
+
+  return 0;
+}
+
+/* git sorts tree entries as if directory names had a trailing slash */
+static int tree_item_compare(const void *a, const void *b) {
+  const struct tree_item_t *left = a, *right = b;
+  size_t llen = strlen(left->name), rlen = strlen(right->name);
+  size_t n = llen < rlen ? llen : rlen;
+  unsigned char lc, rc;
+  int r;
+
+  r = memcmp(left->name, right->name, n);
+  if (r)
+    return r;
+
+  lc = llen > n ? left->name[n] : left->is_dir ? '/' : '\0';
+  rc = rlen > n ? right->name[n] : right->is_dir ? '/' : '\0';
+
+  return lc - rc;
+}
+
+static void tree_items_free(struct tree_item_t *items, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    free(items[i].name);
+  free(items);
+}
+
+static int collect_tree_items(const struct tarball_t *tarball,
+    const char *prefix, struct tree_item_t **items_out, size_t *count_out) {
+  size_t prefix_len = strlen(prefix), count = 0;
+  struct tree_item_t *items = NULL;
+
+  for (size_t i = 0; i < tarball->count; i++) {
+    const struct tar_entry_t *entry = &tarball->entries[i];
+    const char *rest = entry->name, *slash;
+    struct tree_item_t *item = NULL;
+    char *name;
+
+    if (prefix_len) {
+      if (strncmp(rest, prefix, prefix_len) != 0 || rest[prefix_len] != '/')
+        continue;
+      rest += prefix_len + 1;
+    }
+
+    if (*rest == '\0')
+      continue;
+
+    slash = strchr(rest, '/');
+    name = slash ? strndup(rest, slash - rest) : strdup(rest);
+    if (name == NULL) {
+      tree_items_free(items, count);
+      return -ENOMEM;
+    }
+
+    for (size_t j = 0; j < count; j++)
+      if (streq(items[j].name, name)) {
+        item = &items[j];
+        break;
+      }
+
+    if (item) {
+      free(name);
+      if (slash)
+        item->is_dir = true;
+      continue;
+    }
+
+    item = realloc(items, (count + 1) * sizeof(*items));
+    if (item == NULL) {
+      free(name);
+      tree_items_free(items, count);
+      return -ENOMEM;
+    }
+    items = item;
+
+    item = &items[count++];
+    memset(item, 0, sizeof(*item));
+    item->name = name;
+    item->is_dir = slash || entry->type == '5';
+    item->entry = slash ? NULL : entry;
+  }
+
+  *items_out = items;
+  *count_out = count;
+
+  return 0;
+}
+
+static int write_tree(struct git_pack_t *pack, const struct tarball_t *tarball,
+    const char *prefix, unsigned char id[SHA1_DIGEST_LENGTH]) {
+  struct tree_item_t *items;
+  size_t count, written = 0, len = 0;
+  _cleanup_free_ char *buf = NULL;
+  int r;
+
+  r = collect_tree_items(tarball, prefix, &items, &count);
+  if (r < 0)
+    return r;
+
+  for (size_t i = 0; i < count; i++) {
+    struct tree_item_t *item = &items[i];
+    const struct tar_entry_t *entry = item->entry;
+
+    if (item->is_dir) {
+      _cleanup_free_ char *subdir = NULL;
+
+      if (asprintf(&subdir, "%s%s%s", prefix, *prefix ? "/" : "",
+            item->name) < 0) {
+        r = -ENOMEM;
+        goto out;
+      }
+
+      r = write_tree(pack, tarball, subdir, item->id);
+      if (r == -ENODATA)
+        /* git cannot represent empty directories */
+        continue;
+      item->mode = "40000";
+    } else if (entry->type == '2' && entry->linkname) {
+      r = git_pack_add(pack, GIT_OBJ_BLOB, entry->linkname,
+          strlen(entry->linkname), item->id);
+      item->mode = "120000";
+    } else if (entry->type == '0' || entry->type == '7') {
+      r = git_pack_add(pack, GIT_OBJ_BLOB, entry->data, entry->size, item->id);
+      item->mode = entry->mode & 0111 ? "100755" : "100644";
+    } else
+      /* devices, fifos and the like have no place in a source package */
+      continue;
+
+    if (r < 0)
+      goto out;
+
+    written++;
+  }
+
+  if (written == 0) {
+    r = -ENODATA;
+    goto out;
+  }
+
+  qsort(items, count, sizeof(*items), tree_item_compare);
+
+  for (size_t i = 0; i < count; i++) {
+    struct tree_item_t *item = &items[i];
+    size_t entry_len;
+    char *newbuf;
+
+    if (item->mode == NULL)
+      continue;
+
+    entry_len = strlen(item->mode) + 1 + strlen(item->name) + 1 +
+        SHA1_DIGEST_LENGTH;
+    newbuf = realloc(buf, len + entry_len);
+    if (newbuf == NULL) {
+      r = -ENOMEM;
+      goto out;
+    }
+    buf = newbuf;
+
+    len += sprintf(buf + len, "%s %s", item->mode, item->name) + 1;
+    memcpy(buf + len, item->id, SHA1_DIGEST_LENGTH);
+    len += SHA1_DIGEST_LENGTH;
+  }
+
+  r = git_pack_add(pack, GIT_OBJ_TREE, buf, len, id);
+
+out:
+  tree_items_free(items, count);
+  return r;
+}
+
+int git_pack_add_tree(struct git_pack_t *pack, const struct tarball_t *tarball,
+    const char *root, unsigned char id[SHA1_DIGEST_LENGTH]) {
+  return write_tree(pack, tarball, root ? root : "", id);
+}
+
+int git_pack_add_commit(struct git_pack_t *pack,
+    const unsigned char tree[SHA1_DIGEST_LENGTH],
+    const unsigned char *parent, const char *ident, const char *message,
+    unsigned char id[SHA1_DIGEST_LENGTH]) {
+  _cleanup_free_ char *commit = NULL;
+  char tree_hex[SHA1_HEX_LENGTH + 1], parent_hex[SHA1_HEX_LENGTH + 1];
+  long now = time(NULL);
+  int len;
+
+  sha1_to_hex(tree, tree_hex);
+  if (parent)
+    sha1_to_hex(parent, parent_hex);
+
+  len = asprintf(&commit,
+      "tree %s\n"
+      "%s%s%s"
+      "author %s %ld +0000\n"
+      "committer %s %ld +0000\n"
+      "\n"
+      "%s\n",
+      tree_hex,
+      parent ? "parent " : "", parent ? parent_hex : "", parent ? "\n" : "",
+      ident, now, ident, now, message);
+  if (len < 0)
+    return -ENOMEM;
+
+  return git_pack_add(pack, GIT_OBJ_COMMIT, commit, len, id);
+}
+
+/* Returns the payload length of the pkt-line at data, 0 for a flush packet,
+ * or a negative errno if the line is malformed. */
+static int pktline_next(const char *data, size_t len, const char **payload) {
+  char hex[5];
+  char *end;
+  long pktlen;
+
+  if (len < 4)
+    return -EBADMSG;
+
+  memcpy(hex, data, 4);
+  hex[4] = '\0';
+  pktlen = strtol(hex, &end, 16);
+  if (*end != '\0' || (pktlen > 0 && pktlen < 4) || (size_t)pktlen > len)
+    return -EBADMSG;
+
+  *payload = data + 4;
+
+  return pktlen ? pktlen - 4 : 0;
+}
+
+int git_find_ref(const char *advertisement, size_t len, const char *refname,
+    unsigned char id[SHA1_DIGEST_LENGTH]) {
+  const char *p = advertisement, *end = advertisement + len;
+  size_t refname_len = strlen(refname);
+
+  while (p < end) {
+    const char *payload;
+    int n;
+
+    n = pktline_next(p, end - p, &payload);
+    if (n < 0)
+      return n;
+
+    p = payload + n;
+
+    if ((size_t)n < SHA1_HEX_LENGTH + 1 + refname_len ||
+        payload[SHA1_HEX_LENGTH] != ' ')
+      continue;
+
+    if (strncmp(payload + SHA1_HEX_LENGTH + 1, refname, refname_len) != 0)
+      continue;
+
+    /* the refname is followed by capabilities, a newline, or nothing */
+    if ((size_t)n > SHA1_HEX_LENGTH + 1 + refname_len &&
+        payload[SHA1_HEX_LENGTH + 1 + refname_len] != '\0' &&
+        payload[SHA1_HEX_LENGTH + 1 + refname_len] != '\n')
+      continue;
+
+    return sha1_from_hex(payload, id);
+  }
+
+  return -ENOENT;
+}
+
+int git_make_push_request(const unsigned char old[SHA1_DIGEST_LENGTH],
+    const unsigned char new[SHA1_DIGEST_LENGTH], const char *refname,
+    const struct git_pack_t *pack, char **body, size_t *len) {
+  char old_hex[SHA1_HEX_LENGTH + 1], new_hex[SHA1_HEX_LENGTH + 1];
+  _cleanup_free_ char *command = NULL;
+  char *buf;
+  int n;
+
+  sha1_to_hex(old, old_hex);
+  sha1_to_hex(new, new_hex);
+
+  n = asprintf(&command, "%s %s %s%creport-status agent=burp/%s\n",
+      old_hex, new_hex, refname, '\0', PACKAGE_VERSION);
+  if (n < 0)
+    return -ENOMEM;
+
+  buf = malloc(4 + n + 4 + pack->len);
+  if (buf == NULL)
+    return -ENOMEM;
+
+  sprintf(buf, "%04x", n + 4);
+  memcpy(buf + 4, command, n);
+  memcpy(buf + 4 + n, "0000", 4);
+  memcpy(buf + 8 + n, pack->data, pack->len);
+
+  *body = buf;
+  *len = 8 + n + pack->len;
+
+  return 0;
+}
+
+int git_read_report_status(const char *data, size_t len, char **error) {
+  const char *p = data, *end = data + len;
+  bool unpacked = false, updated = false;
+
+  while (p < end) {
+    _cleanup_free_ char *line = NULL;
+    const char *payload;
+    int n;
+
+    n = pktline_next(p, end - p, &payload);
+    if (n < 0)
+      return n;
+    p = payload + n;
+
+    if (n == 0)
+      break;
+
+    line = strndup(payload, n);
+    if (line == NULL)
+      return -ENOMEM;
+    line[strcspn(line, "\n")] = '\0';
+
+    if (strncmp(line, "unpack ", 7) == 0) {
+      if (!streq(line + 7, "ok")) {
+        if (error && asprintf(error, "remote failed to unpack: %s",
+              line + 7) < 0)
+          return -ENOMEM;
+        return -EBADMSG;
+      }
+      unpacked = true;
+    } else if (strncmp(line, "ok ", 3) == 0)
+      updated = true;
+    else if (strncmp(line, "ng ", 3) == 0) {
+      const char *reason = strchr(line + 3, ' ');
+
+      if (error) {
+        *error = strdup(reason ? reason + 1 : line + 3);
+        if (*error == NULL)
+          return -ENOMEM;
+      }
+      return -EKEYREJECTED;
+    }
+  }
+
+  return unpacked && updated ? 0 : -EBADMSG;
+}
+
+/* vim: set et ts=2 sw=2: */
@@ -0,0 +1,46 @@
+#ifndef _GIT_H
+#define _GIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha1.h"
+#include "tarball.h"
+
+enum {
+  GIT_OBJ_COMMIT = 1,
+  GIT_OBJ_TREE   = 2,
+  GIT_OBJ_BLOB   = 3,
+};
+
+/* A version 2 packfile built in memory. */
+struct git_pack_t {
+  char *data;
+  size_t len;
+  size_t alloc;
+  uint32_t count;
+};
+
+int git_pack_init(struct git_pack_t *pack);
+void git_pack_free(struct git_pack_t *pack);
+int git_pack_add(struct git_pack_t *pack, int type, const void *data,
+    size_t len, unsigned char id[SHA1_DIGEST_LENGTH]);
+int git_pack_add_tree(struct git_pack_t *pack, const struct tarball_t *tarball,
+    const char *root, unsigned char id[SHA1_DIGEST_LENGTH]);
+int git_pack_add_commit(struct git_pack_t *pack,
+    const unsigned char tree[SHA1_DIGEST_LENGTH],
+    const unsigned char *parent, const char *ident, const char *message,
+    unsigned char id[SHA1_DIGEST_LENGTH]);
+int git_pack_finish(struct git_pack_t *pack);
+
+/* smart HTTP protocol helpers */
+int git_find_ref(const char *advertisement, size_t len, const char *refname,
+    unsigned char id[SHA1_DIGEST_LENGTH]);
+int git_make_push_request(const unsigned char old[SHA1_DIGEST_LENGTH],
+    const unsigned char new[SHA1_DIGEST_LENGTH], const char *refname,
+    const struct git_pack_t *pack, char **body, size_t *len);
+int git_read_report_status(const char *data, size_t len, char **error);
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _GIT_H */
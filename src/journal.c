@@ -0,0 +1,421 @@
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+static int mkdir_parents(const char *path) {
+  _cleanup_free_ char *dir = strdup(path);
+  char *p;
+
+  if (dir == NULL)
+    return -ENOMEM;
+
+  for (p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+      return -errno;
+    *p = '/';
+  }
+
+  return 0;
+}
+
+static int hash_file(const char *path, char hex[SHA1_HEX_LENGTH + 1]) {
+  _cleanup_fclose_ FILE *fp = NULL;
+  unsigned char digest[SHA1_DIGEST_LENGTH];
+  char buf[BUFSIZ * 8];
+  struct sha1_t sha;
+  size_t n;
+
+  fp = fopen(path, "re");
+  if (fp == NULL)
+    return -errno;
+
+  sha1_init(&sha);
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    sha1_update(&sha, buf, n);
+
+  if (ferror(fp))
+    return -EIO;
+
+  sha1_final(&sha, digest);
+  sha1_to_hex(digest, hex);
+
+  return 0;
+}
+
+static char *absolute_path(const char *path) {
+  char *abspath = realpath(path, NULL);
+
+  return abspath ? abspath : strdup(path);
+}
+
+static int append_entry(struct journal_t *journal, const char *path,
+    const char *hash, bool success) {
+  struct journal_entry_t *entries;
+  char *p;
+
+  p = strdup(path);
+  if (p == NULL)
+    return -ENOMEM;
+
+  entries = realloc(journal->entries,
+      (journal->count + 1) * sizeof(*entries));
+  if (entries == NULL) {
+    free(p);
+    return -ENOMEM;
+  }
+
+  journal->entries = entries;
+  entries[journal->count].path = p;
+  memcpy(entries[journal->count].hash, hash, SHA1_HEX_LENGTH + 1);
+  entries[journal->count].success = success;
+  journal->count++;
+
+  return 0;
+}
+
+/* Each line is "<ok|fail> <sha1> <path>". Later lines override earlier ones,
+ * and a line torn by a crash is ignored. */
+static int journal_load(struct journal_t *journal, FILE *fp) {
+  _cleanup_free_ char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  int r;
+
+  while ((len = getline(&line, &size, fp)) > 0) {
+    char *status, *hash, *path = line;
+
+    if (line[len - 1] != '\n')
+      break;
+    line[len - 1] = '\0';
+
+    status = strsep(&path, " ");
+    hash = strsep(&path, " ");
+    if (path == NULL || strlen(hash) != SHA1_HEX_LENGTH ||
+        (!streq(status, "ok") && !streq(status, "fail")))
+      continue;
+
+    r = append_entry(journal, path, hash, streq(status, "ok"));
+    if (r < 0)
+      return r;
+  }
+
+  return 0;
+}
+
+static int fsync_parent(const char *path) {
+  _cleanup_free_ char *dir = strdup(path);
+  char *slash;
+  int fd, r = 0;
+
+  if (dir == NULL)
+    return -ENOMEM;
+
+  slash = strrchr(dir, '/');
+  if (slash == NULL)
+    strcpy(dir, ".");
+  else if (slash == dir)
+    slash[1] = '\0';
+  else
+    *slash = '\0';
+
+  fd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+
+  if (fsync(fd) < 0)
+    r = -errno;
+  close(fd);
+
+  return r;
+}
+
+/* Only the latest outcome per path is ever consulted, since an older entry
+ * is for a tarball which has changed since. */
+static bool superseded(const struct journal_t *journal, size_t i) {
+  for (size_t j = i + 1; j < journal->count; j++)
+    if (streq(journal->entries[j].path, journal->entries[i].path))
+      return true;
+
+  return false;
+}
+
+/* Waits for other runs to be done with the journal. Compaction replaces the
+ * file, so the lock is held on a file of its own. Closing the returned
+ * descriptor releases it. */
+static int journal_lock(const char *path) {
+  _cleanup_free_ char *lockpath = NULL;
+  int fd;
+
+  if (asprintf(&lockpath, "%s.lock", path) < 0)
+    return -ENOMEM;
+
+  fd = open(lockpath, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -errno;
+
+  while (flock(fd, LOCK_EX) < 0) {
+    if (errno != EINTR) {
+      int r = -errno;
+      close(fd);
+      return r;
+    }
+  }
+
+  return fd;
+}
+
+/* Replaces the journal with the latest outcome per path of the entries just
+ * loaded. The caller holds the lock. The new file is complete and durable before it takes the place of
+ * the old one, so a crash at any point leaves one or the other intact. */
+static int journal_compact(struct journal_t *journal, const char *path) {
+  _cleanup_free_ char *tmp = NULL;
+  _cleanup_fclose_ FILE *fp = NULL;
+  int r = 0;
+
+  if (asprintf(&tmp, "%s.tmp", path) < 0)
+    return -ENOMEM;
+
+  fp = fopen(tmp, "we");
+  if (fp == NULL)
+    return -errno;
+
+  for (size_t i = 0; i < journal->count; i++) {
+    const struct journal_entry_t *entry = &journal->entries[i];
+
+    if (!superseded(journal, i))
+      fprintf(fp, "%s %s %s\n", entry->success ? "ok" : "fail", entry->hash,
+          entry->path);
+  }
+
+  if (fflush(fp) != 0 || ferror(fp) || fsync(fileno(fp)) < 0)
+    r = errno ? -errno : -EIO;
+  else if (rename(tmp, path) < 0)
+    r = -errno;
+
+  if (r < 0)
+    unlink(tmp);
+
+  return r;
+}
+
+int journal_open(struct journal_t *journal, const char *path) {
+  _cleanup_fclose_ FILE *fp = NULL;
+  int lock, r;
+
+  memset(journal, 0, sizeof(*journal));
+  journal->fd = -1;
+
+  journal->path = strdup(path);
+  if (journal->path == NULL)
+    return -ENOMEM;
+
+  r = mkdir_parents(path);
+  if (r < 0) {
+    journal_close(journal);
+    return r;
+  }
+
+  lock = journal_lock(path);
+  if (lock < 0) {
+    journal_close(journal);
+    return lock;
+  }
+
+  /* Outcomes of earlier runs are kept whether or not this run resumes, so
+   * that a later --resume still knows what an interrupted run finished. */
+  fp = fopen(path, "re");
+  if (fp) {
+    r = journal_load(journal, fp);
+    if (r == 0)
+      r = journal_compact(journal, path);
+  } else if (errno != ENOENT)
+    r = -errno;
+
+  if (r == 0) {
+    journal->fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC|O_APPEND, 0644);
+    if (journal->fd < 0)
+      r = -errno;
+  }
+
+  /* make the new or renamed file itself durable, not only its contents */
+  if (r == 0)
+    r = fsync_parent(path);
+
+  close(lock);
+
+  if (r < 0)
+    journal_close(journal);
+
+  return r;
+}
+
+void journal_close(struct journal_t *journal) {
+  if (journal->fd >= 0)
+    close(journal->fd);
+  free(journal->path);
+
+  for (size_t i = 0; i < journal->count; i++)
+    free(journal->entries[i].path);
+  free(journal->entries);
+
+  memset(journal, 0, sizeof(*journal));
+  journal->fd = -1;
+}
+
+static void hash_memory(const void *data, size_t len,
+    char hex[SHA1_HEX_LENGTH + 1]) {
+  unsigned char digest[SHA1_DIGEST_LENGTH];
+  struct sha1_t sha;
+
+  sha1_init(&sha);
+  sha1_update(&sha, data, len);
+  sha1_final(&sha, digest);
+  sha1_to_hex(digest, hex);
+}
+
+static bool lookup(const struct journal_t *journal, const char *path,
+    const char *hash) {
+  /* the most recent outcome for this exact tarball wins */
+  for (size_t i = journal->count; i-- > 0;) {
+    const struct journal_entry_t *entry = &journal->entries[i];
+
+    if (streq(entry->path, path) && streq(entry->hash, hash))
+      return entry->success;
+  }
+
+  return false;
+}
+
+/* Another run may have compacted the journal since it was opened, leaving
+ * the descriptor on a file which is no longer linked. The caller holds the
+ * lock. */
+static int journal_reopen(struct journal_t *journal) {
+  struct stat st, cur;
+  int fd;
+
+  if (fstat(journal->fd, &cur) < 0)
+    return -errno;
+
+  if (stat(journal->path, &st) == 0 &&
+      st.st_dev == cur.st_dev && st.st_ino == cur.st_ino)
+    return 0;
+
+  fd = open(journal->path, O_RDWR|O_CREAT|O_CLOEXEC|O_APPEND, 0644);
+  if (fd < 0)
+    return -errno;
+
+  close(journal->fd);
+  journal->fd = fd;
+
+  return fsync_parent(journal->path);
+}
+
+static int record(struct journal_t *journal, const char *path,
+    const char *hash, bool success) {
+  _cleanup_free_ char *line = NULL;
+  int len, lock, r;
+
+  len = asprintf(&line, "%s %s %s\n", success ? "ok" : "fail", hash, path);
+  if (len < 0)
+    return -ENOMEM;
+
+  lock = journal_lock(journal->path);
+  if (lock < 0)
+    return lock;
+
+  /* under the lock no other run appends or compacts, so the line lands
+   * whole at the end of the current file */
+  r = journal_reopen(journal);
+  if (r == 0 && write(journal->fd, line, len) != len)
+    r = errno ? -errno : -EIO;
+  if (r == 0 && fsync(journal->fd) < 0)
+    r = -errno;
+
+  close(lock);
+
+  if (r < 0)
+    return r;
+
+  return append_entry(journal, path, hash, success);
+}
+
+bool journal_is_done(const struct journal_t *journal, const char *tarball) {
+  _cleanup_free_ char *path = NULL;
+  char hash[SHA1_HEX_LENGTH + 1];
+
+  if (journal->count == 0)
+    return false;
+
+  path = absolute_path(tarball);
+  if (path == NULL || hash_file(tarball, hash) < 0)
+    return false;
+
+  return lookup(journal, path, hash);
+}
+
+int journal_record(struct journal_t *journal, const char *tarball,
+    bool success) {
+  _cleanup_free_ char *path = NULL;
+  char hash[SHA1_HEX_LENGTH + 1];
+  int r;
+
+  path = absolute_path(tarball);
+  if (path == NULL)
+    return -ENOMEM;
+
+  if (strchr(path, '\n'))
+    return -EINVAL;
+
+  r = hash_file(tarball, hash);
+  if (r < 0)
+    return r;
+
+  return record(journal, path, hash, success);
+}
+
+bool journal_is_done_memory(const struct journal_t *journal, const char *name,
+    const void *data, size_t len) {
+  _cleanup_free_ char *path = NULL;
+  char hash[SHA1_HEX_LENGTH + 1];
+
+  if (journal->count == 0)
+    return false;
+
+  path = absolute_path(name);
+  if (path == NULL)
+    return false;
+
+  hash_memory(data, len, hash);
+
+  return lookup(journal, path, hash);
+}
+
+int journal_record_memory(struct journal_t *journal, const char *name,
+    const void *data, size_t len, bool success) {
+  _cleanup_free_ char *path = NULL;
+  char hash[SHA1_HEX_LENGTH + 1];
+
+  path = absolute_path(name);
+  if (path == NULL)
+    return -ENOMEM;
+
+  if (strchr(path, '\n'))
+    return -EINVAL;
+
+  hash_memory(data, len, hash);
+
+  return record(journal, path, hash, success);
+}
+
+/* vim: set et ts=2 sw=2: */
@@ -0,0 +1,50 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "sha1.h"
+#include "util.h"
+
+struct journal_entry_t {
+  char *path;
+  char hash[SHA1_HEX_LENGTH + 1];
+  bool success;
+};
+
+/* An append-only record of upload outcomes, keyed by the absolute path and
+ * SHA-1 of each tarball. Every record is flushed to disk before the next
+ * upload starts, so an interrupted run can be resumed. Opening the journal
+ * loads the records of earlier runs and compacts them to the latest outcome
+ * per path. Runs sharing a journal take turns through a lock file next to
+ * it, so none loses the records of another. */
+struct journal_t {
+  int fd;
+  char *path;
+
+  struct journal_entry_t *entries;
+  size_t count;
+};
+
+int journal_open(struct journal_t *journal, const char *path);
+void journal_close(struct journal_t *journal);
+
+bool journal_is_done(const struct journal_t *journal, const char *tarball);
+int journal_record(struct journal_t *journal, const char *tarball,
+    bool success);
+
+/* As above for a tarball held in memory, keyed by name instead. */
+bool journal_is_done_memory(const struct journal_t *journal, const char *name,
+    const void *data, size_t len);
+int journal_record_memory(struct journal_t *journal, const char *name,
+    const void *data, size_t len, bool success);
+
+static inline void journal_closep(struct journal_t *journal) {
+  journal_close(journal);
+}
+#define _cleanup_journal_ _cleanup_(journal_closep)
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _JOURNAL_H */
@@ -0,0 +1,32 @@
+#ifndef _PROBES_H
+#define _PROBES_H
+
+/* Static tracepoints for perf, bpftrace and SystemTap, all under the "burp"
+ * provider. When configure finds sys/sdt.h each probe is a single nop plus
+ * an ELF note; otherwise they compile to nothing. Arguments are evaluated
+ * either way, so keep them to values which are already at hand. List the
+ * probes of a build with:
+ *
+ *   bpftrace -l 'usdt:/usr/bin/burp:*'
+ */
+
+#ifdef HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+# define PROBE0(name)             DTRACE_PROBE(burp, name)
+# define PROBE1(name, a)          DTRACE_PROBE1(burp, name, a)
+# define PROBE2(name, a, b)       DTRACE_PROBE2(burp, name, a, b)
+# define PROBE3(name, a, b, c)    DTRACE_PROBE3(burp, name, a, b, c)
+# define PROBE4(name, a, b, c, d) DTRACE_PROBE4(burp, name, a, b, c, d)
+#else
+# define PROBE0(name)             do { } while (0)
+# define PROBE1(name, a)          do { (void)(a); } while (0)
+# define PROBE2(name, a, b)       do { (void)(a); (void)(b); } while (0)
+# define PROBE3(name, a, b, c) \
+  do { (void)(a); (void)(b); (void)(c); } while (0)
+# define PROBE4(name, a, b, c, d) \
+  do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#endif
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _PROBES_H */
@@ -0,0 +1,295 @@
+#include "recompress.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "util.h"
+
+#define CHUNK_SIZE   (1024 * 1024)
+#define DICT_SIZE    32768
+#define MAX_THREADS  32
+
+/* the estimate compresses at least this many samples from across the
+ * input, rounded up to keep every thread busy */
+#define SAMPLE_COUNT 4
+#define SAMPLE_SIZE  (256 * 1024)
+
+/* gzip framing: a fixed header advertising maximum compression, and a
+ * trailer holding the CRC and length of the uncompressed data */
+#define GZIP_HEADER_SIZE  10
+#define GZIP_TRAILER_SIZE 8
+
+struct chunk_t {
+  const unsigned char *data;
+  size_t len;
+  size_t dict_len;  /* bytes before data to prime the window with */
+  bool last;
+
+  unsigned char *out;
+  size_t out_len;
+  uLong crc;
+  int result;
+};
+
+struct pool_t {
+  struct chunk_t *chunks;
+  size_t count;
+  size_t next;
+};
+
+/* Deflates one chunk as raw deflate data. All but the last chunk end on a
+ * byte boundary without the final block flag, so the chunks can simply be
+ * concatenated. */
+static int deflate_chunk(struct chunk_t *chunk) {
+  z_stream zs = {};
+  size_t alloc;
+  int flush = chunk->last ? Z_FINISH : Z_SYNC_FLUSH, r;
+
+  if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 9,
+        Z_DEFAULT_STRATEGY) != Z_OK)
+    return -ENOMEM;
+
+  /* continue from the previous chunk's window */
+  if (chunk->dict_len)
+    deflateSetDictionary(&zs, chunk->data - chunk->dict_len, chunk->dict_len);
+
+  alloc = deflateBound(&zs, chunk->len) + 16;
+  chunk->out = malloc(alloc);
+  if (chunk->out == NULL) {
+    deflateEnd(&zs);
+    return -ENOMEM;
+  }
+
+  zs.next_in = (unsigned char *)chunk->data;
+  zs.avail_in = chunk->len;
+
+  for (;;) {
+    unsigned char *out;
+
+    zs.next_out = chunk->out + zs.total_out;
+    zs.avail_out = alloc - zs.total_out;
+
+    r = deflate(&zs, flush);
+    if (r == Z_STREAM_END || (r == Z_OK && zs.avail_out > 0))
+      break;
+    if (r != Z_OK && r != Z_BUF_ERROR)
+      break;
+
+    alloc *= 2;
+    out = realloc(chunk->out, alloc);
+    if (out == NULL) {
+      r = Z_MEM_ERROR;
+      break;
+    }
+    chunk->out = out;
+  }
+
+  chunk->out_len = zs.total_out;
+  deflateEnd(&zs);
+
+  if (r == Z_MEM_ERROR)
+    return -ENOMEM;
+  if (r != (chunk->last ? Z_STREAM_END : Z_OK))
+    return -EIO;
+
+  chunk->crc = crc32(crc32(0, NULL, 0), chunk->data, chunk->len);
+
+  return 0;
+}
+
+static void *pool_worker(void *userdata) {
+  struct pool_t *pool = userdata;
+
+  for (;;) {
+    size_t i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+    if (i >= pool->count)
+      return NULL;
+
+    pool->chunks[i].result = deflate_chunk(&pool->chunks[i]);
+  }
+}
+
+static size_t thread_count(size_t chunks) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threads = cpus > 0 ? (size_t)cpus : 1;
+
+  if (threads > MAX_THREADS)
+    threads = MAX_THREADS;
+
+  return threads < chunks ? threads : chunks;
+}
+
+/* Compresses the chunks on up to nthreads threads, this one included. */
+static int pool_run(struct chunk_t *chunks, size_t count, size_t nthreads) {
+  _cleanup_free_ pthread_t *threads = NULL;
+  struct pool_t pool = { .chunks = chunks, .count = count };
+  size_t started = 0;
+
+  threads = calloc(nthreads, sizeof(*threads));
+  if (threads == NULL)
+    return -ENOMEM;
+
+  /* this thread works through the chunks alongside the others */
+  for (size_t i = 1; i < nthreads; i++) {
+    if (pthread_create(&threads[i], NULL, pool_worker, &pool) != 0)
+      break;
+    started = i;
+  }
+  pool_worker(&pool);
+  for (size_t i = 1; i <= started; i++)
+    pthread_join(threads[i], NULL);
+
+  return 0;
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void chunk_init(struct chunk_t *chunk, const unsigned char *data,
+    size_t len, size_t offset, size_t total) {
+  memset(chunk, 0, sizeof(*chunk));
+  chunk->data = data + offset;
+  chunk->len = len;
+  chunk->last = offset + len == total;
+  chunk->dict_len = offset < DICT_SIZE ? offset : DICT_SIZE;
+}
+
+/* Compresses samples spread over the data on as many threads as the real
+ * job would use, and extrapolates the size and time of the whole job from
+ * them. Timing the samples on the pool rather than on one thread accounts
+ * for thread startup and for the threads competing for memory bandwidth and
+ * shared cores. */
+int recompress_estimate(const void *data, size_t len, size_t total,
+    struct recompress_estimate_t *estimate) {
+  _cleanup_free_ struct chunk_t *samples = NULL;
+  size_t nthreads, count, sample_len = SAMPLE_SIZE;
+  size_t in = 0, out = 0;
+  double start, elapsed;
+  int r = 0;
+
+  if (len == 0 || total < len)
+    return -EINVAL;
+
+  nthreads = thread_count((total + CHUNK_SIZE - 1) / CHUNK_SIZE);
+  count = (SAMPLE_COUNT + nthreads - 1) / nthreads * nthreads;
+  if (len < count * SAMPLE_SIZE) {
+    count = nthreads;
+    sample_len = len / count;
+  }
+
+  samples = calloc(count, sizeof(*samples));
+  if (samples == NULL)
+    return -ENOMEM;
+
+  for (size_t i = 0; i < count; i++) {
+    size_t offset = count > 1 ? (len - sample_len) / (count - 1) * i : 0;
+
+    chunk_init(&samples[i], data, sample_len, offset, total);
+    samples[i].last = true;
+  }
+
+  start = now_seconds();
+  r = pool_run(samples, count, nthreads);
+  elapsed = now_seconds() - start;
+
+  for (size_t i = 0; i < count; i++) {
+    if (r == 0)
+      r = samples[i].result;
+    in += samples[i].len;
+    out += samples[i].out_len;
+    free(samples[i].out);
+  }
+  if (r < 0)
+    return r;
+
+  estimate->size = GZIP_HEADER_SIZE + GZIP_TRAILER_SIZE +
+    (size_t)((double)out * total / in);
+  estimate->seconds = elapsed * total / in;
+
+  return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static void put_le32(unsigned char *p, uint32_t v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+}
+
+int recompress_write(const void *data, size_t len, int fd) {
+  static const unsigned char header[GZIP_HEADER_SIZE] = {
+    0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 2 /* max compression */, 3 /* unix */
+  };
+  unsigned char trailer[GZIP_TRAILER_SIZE];
+  _cleanup_free_ struct chunk_t *chunks = NULL;
+  size_t count;
+  uLong crc = crc32(0, NULL, 0);
+  int r;
+
+  if (len == 0)
+    return -EINVAL;
+
+  count = (len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  chunks = calloc(count, sizeof(*chunks));
+  if (chunks == NULL)
+    return -ENOMEM;
+
+  for (size_t i = 0; i < count; i++) {
+    size_t offset = i * CHUNK_SIZE;
+    chunk_init(&chunks[i], data, len - offset < CHUNK_SIZE ?
+        len - offset : CHUNK_SIZE, offset, len);
+  }
+
+  r = pool_run(chunks, count, thread_count(count));
+  if (r < 0)
+    return r;
+
+  r = write_all(fd, header, sizeof(header));
+  for (size_t i = 0; i < count; i++) {
+    if (r == 0)
+      r = chunks[i].result;
+    if (r == 0)
+      r = write_all(fd, chunks[i].out, chunks[i].out_len);
+    if (r == 0)
+      crc = crc32_combine(crc, chunks[i].crc, chunks[i].len);
+    free(chunks[i].out);
+  }
+  if (r < 0)
+    return r;
+
+  put_le32(trailer, crc);
+  put_le32(trailer + 4, (uint32_t)len);
+
+  return write_all(fd, trailer, sizeof(trailer));
+}
+
+/* vim: set et ts=2 sw=2: */
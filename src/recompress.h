@@ -0,0 +1,25 @@
+#ifndef _RECOMPRESS_H
+#define _RECOMPRESS_H
+
+#include <stddef.h>
+
+/* Recompresses tar data as gzip at the strongest deflate setting, split into
+ * chunks which are compressed in parallel. Each chunk is primed with the tail
+ * of the one before it, so the result is a single gzip member about as small
+ * as a serial run would make it. The AUR only accepts gzip, so a stronger
+ * codec is not an option. */
+
+struct recompress_estimate_t {
+  size_t size;     /* expected size of the gzip output */
+  double seconds;  /* expected wall clock time to produce it */
+};
+
+/* Estimates the job for total bytes of tar data from the len bytes at data,
+ * which may be just the start of it. */
+int recompress_estimate(const void *data, size_t len, size_t total,
+    struct recompress_estimate_t *estimate);
+int recompress_write(const void *data, size_t len, int fd);
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _RECOMPRESS_H */
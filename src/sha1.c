@@ -0,0 +1,145 @@
+#include "sha1.h"
+
+#include <errno.h>
+#include <string.h>
+
+#define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+static void sha1_transform(uint32_t state[5], const unsigned char block[64]) {
+  uint32_t a, b, c, d, e, w[80];
+
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+        (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+  for (int i = 16; i < 80; i++)
+    w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+  a = state[0];
+  b = state[1];
+  c = state[2];
+  d = state[3];
+  e = state[4];
+
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k, t;
+
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+
+    t = rol(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rol(b, 30);
+    b = a;
+    a = t;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+void sha1_init(struct sha1_t *ctx) {
+  ctx->state[0] = 0x67452301;
+  ctx->state[1] = 0xefcdab89;
+  ctx->state[2] = 0x98badcfe;
+  ctx->state[3] = 0x10325476;
+  ctx->state[4] = 0xc3d2e1f0;
+  ctx->count = 0;
+}
+
+void sha1_update(struct sha1_t *ctx, const void *data, size_t len) {
+  const unsigned char *p = data;
+  size_t used = ctx->count % 64;
+
+  ctx->count += len;
+
+  if (used) {
+    size_t fill = 64 - used;
+
+    if (len < fill) {
+      memcpy(ctx->buffer + used, p, len);
+      return;
+    }
+
+    memcpy(ctx->buffer + used, p, fill);
+    sha1_transform(ctx->state, ctx->buffer);
+    p += fill;
+    len -= fill;
+  }
+
+  for (; len >= 64; p += 64, len -= 64)
+    sha1_transform(ctx->state, p);
+
+  memcpy(ctx->buffer, p, len);
+}
+
+void sha1_final(struct sha1_t *ctx, unsigned char digest[SHA1_DIGEST_LENGTH]) {
+  static const unsigned char pad[64] = { 0x80 };
+  uint64_t bits = ctx->count * 8;
+  unsigned char length[8];
+  size_t used = ctx->count % 64;
+
+  for (int i = 0; i < 8; i++)
+    length[i] = bits >> (56 - i * 8);
+
+  sha1_update(ctx, pad, used < 56 ? 56 - used : 120 - used);
+  sha1_update(ctx, length, sizeof(length));
+
+  for (int i = 0; i < SHA1_DIGEST_LENGTH; i++)
+    digest[i] = ctx->state[i / 4] >> (24 - (i % 4) * 8);
+}
+
+void sha1_to_hex(const unsigned char digest[SHA1_DIGEST_LENGTH],
+    char hex[SHA1_HEX_LENGTH + 1]) {
+  static const char digits[] = "0123456789abcdef";
+
+  for (int i = 0; i < SHA1_DIGEST_LENGTH; i++) {
+    hex[i * 2] = digits[digest[i] >> 4];
+    hex[i * 2 + 1] = digits[digest[i] & 0xf];
+  }
+
+  hex[SHA1_HEX_LENGTH] = '\0';
+}
+
+static int hexval(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+int sha1_from_hex(const char *hex, unsigned char digest[SHA1_DIGEST_LENGTH]) {
+  for (int i = 0; i < SHA1_DIGEST_LENGTH; i++) {
+    int hi = hexval(hex[i * 2]), lo;
+
+    if (hi < 0)
+      return -EINVAL;
+
+    lo = hexval(hex[i * 2 + 1]);
+    if (lo < 0)
+      return -EINVAL;
+
+    digest[i] = hi << 4 | lo;
+  }
+
+  return 0;
+}
+
+/* vim: set et ts=2 sw=2: */
@@ -0,0 +1,26 @@
+#ifndef _SHA1_H
+#define _SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_DIGEST_LENGTH 20
+#define SHA1_HEX_LENGTH    (SHA1_DIGEST_LENGTH * 2)
+
+struct sha1_t {
+  uint32_t state[5];
+  uint64_t count;
+  unsigned char buffer[64];
+};
+
+void sha1_init(struct sha1_t *ctx);
+void sha1_update(struct sha1_t *ctx, const void *data, size_t len);
+void sha1_final(struct sha1_t *ctx, unsigned char digest[SHA1_DIGEST_LENGTH]);
+
+void sha1_to_hex(const unsigned char digest[SHA1_DIGEST_LENGTH],
+    char hex[SHA1_HEX_LENGTH + 1]);
+int sha1_from_hex(const char *hex, unsigned char digest[SHA1_DIGEST_LENGTH]);
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _SHA1_H */
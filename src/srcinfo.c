@@ -0,0 +1,207 @@
+#include "srcinfo.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tarball.h"
+#include "util.h"
+
+static int set_field(char **field, const char *value) {
+  /* split packages may override fields; the pkgbase section wins */
+  if (*field)
+    return 0;
+
+  *field = strdup(value);
+  return *field ? 0 : -ENOMEM;
+}
+
+static int append_field(char ***array, size_t *count, const char *value) {
+  char **newarray, *v;
+
+  v = strdup(value);
+  if (v == NULL)
+    return -ENOMEM;
+
+  newarray = realloc(*array, (*count + 1) * sizeof(char *));
+  if (newarray == NULL) {
+    free(v);
+    return -ENOMEM;
+  }
+
+  newarray[(*count)++] = v;
+  *array = newarray;
+
+  return 0;
+}
+
+/* Matches key and its architecture specific forms, such as depends_x86_64. */
+static bool is_key(const char *key, const char *name) {
+  size_t len = strlen(name);
+
+  return strncmp(key, name, len) == 0 && (key[len] == '\0' || key[len] == '_');
+}
+
+static int parse_line(struct srcinfo_t *srcinfo, char *line) {
+  char *key = line, *value, *end;
+
+  while (isspace((unsigned char)*key))
+    key++;
+
+  if (*key == '\0' || *key == '#')
+    return 0;
+
+  value = strstr(key, " = ");
+  if (value == NULL)
+    return 0;
+
+  *value = '\0';
+  value += 3;
+
+  end = value + strlen(value);
+  while (end > value && isspace((unsigned char)end[-1]))
+    *--end = '\0';
+
+  if (streq(key, "pkgbase"))
+    return set_field(&srcinfo->pkgbase, value);
+  if (streq(key, "pkgver"))
+    return set_field(&srcinfo->pkgver, value);
+  if (streq(key, "pkgrel"))
+    return set_field(&srcinfo->pkgrel, value);
+  if (streq(key, "epoch"))
+    return set_field(&srcinfo->epoch, value);
+  if (streq(key, "pkgname"))
+    return append_field(&srcinfo->pkgnames, &srcinfo->pkgname_count, value);
+  if (is_key(key, "depends") || is_key(key, "makedepends")) {
+    value[strcspn(value, "<>=")] = '\0';
+    return append_field(&srcinfo->depends, &srcinfo->depend_count, value);
+  }
+  if (is_key(key, "source")) {
+    char *name;
+
+    if (strstr(value, "://"))
+      return 0;
+
+    /* makepkg looks local sources up by their file name */
+    name = strrchr(value, '/');
+    return append_field(&srcinfo->files, &srcinfo->file_count,
+        name ? name + 1 : value);
+  }
+  if (streq(key, "install") || streq(key, "changelog"))
+    return append_field(&srcinfo->files, &srcinfo->file_count, value);
+
+  return 0;
+}
+
+int srcinfo_parse(struct srcinfo_t *srcinfo, const char *data, size_t len) {
+  const char *p = data, *end = data + len;
+  int r;
+
+  memset(srcinfo, 0, sizeof(*srcinfo));
+
+  while (p < end) {
+    _cleanup_free_ char *line = NULL;
+    const char *eol;
+
+    eol = memchr(p, '\n', end - p);
+    if (eol == NULL)
+      eol = end;
+
+    line = strndup(p, eol - p);
+    if (line == NULL) {
+      srcinfo_free(srcinfo);
+      return -ENOMEM;
+    }
+
+    r = parse_line(srcinfo, line);
+    if (r < 0) {
+      srcinfo_free(srcinfo);
+      return r;
+    }
+
+    p = eol + 1;
+  }
+
+  if (srcinfo->pkgbase == NULL || srcinfo->pkgver == NULL ||
+      srcinfo->pkgrel == NULL || srcinfo->pkgname_count == 0) {
+    srcinfo_free(srcinfo);
+    return -EBADMSG;
+  }
+
+  return 0;
+}
+
+int srcinfo_read_archive(struct srcinfo_t *srcinfo,
+    const struct tarball_t *tarball) {
+  /* makepkg places everything under a single pkgbase directory */
+  for (size_t i = 0; i < tarball->count; i++) {
+    const struct tar_entry_t *entry = &tarball->entries[i];
+    const char *slash = strchr(entry->name, '/');
+
+    if (slash && streq(slash + 1, ".SRCINFO") && entry->type == '0')
+      return srcinfo_parse(srcinfo, entry->data, entry->size);
+  }
+
+  return -ENOENT;
+}
+
+int srcinfo_read_tarball(struct srcinfo_t *srcinfo, const char *tarball_path) {
+  _cleanup_tarball_ struct tarball_t tarball = {};
+  int r;
+
+  r = tarball_load(&tarball, tarball_path);
+  if (r < 0)
+    return r;
+
+  return srcinfo_read_archive(srcinfo, &tarball);
+}
+
+int srcinfo_read_memory(struct srcinfo_t *srcinfo, const void *data,
+    size_t len) {
+  _cleanup_tarball_ struct tarball_t tarball = {};
+  int r;
+
+  r = tarball_load_memory(&tarball, data, len);
+  if (r < 0)
+    return r;
+
+  return srcinfo_read_archive(srcinfo, &tarball);
+}
+
+void srcinfo_free(struct srcinfo_t *srcinfo) {
+  free(srcinfo->pkgbase);
+  free(srcinfo->pkgver);
+  free(srcinfo->pkgrel);
+  free(srcinfo->epoch);
+
+  for (size_t i = 0; i < srcinfo->pkgname_count; i++)
+    free(srcinfo->pkgnames[i]);
+  free(srcinfo->pkgnames);
+
+  for (size_t i = 0; i < srcinfo->depend_count; i++)
+    free(srcinfo->depends[i]);
+  free(srcinfo->depends);
+
+  for (size_t i = 0; i < srcinfo->file_count; i++)
+    free(srcinfo->files[i]);
+  free(srcinfo->files);
+
+  memset(srcinfo, 0, sizeof(*srcinfo));
+}
+
+char *srcinfo_version(const struct srcinfo_t *srcinfo) {
+  char *version;
+  int r;
+
+  if (srcinfo->epoch && !streq(srcinfo->epoch, "0"))
+    r = asprintf(&version, "%s:%s-%s", srcinfo->epoch, srcinfo->pkgver,
+        srcinfo->pkgrel);
+  else
+    r = asprintf(&version, "%s-%s", srcinfo->pkgver, srcinfo->pkgrel);
+
+  return r < 0 ? NULL : version;
+}
+
+/* vim: set et ts=2 sw=2: */
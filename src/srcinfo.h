@@ -0,0 +1,48 @@
+#ifndef _SRCINFO_H
+#define _SRCINFO_H
+
+#include <stddef.h>
+
+#include "util.h"
+
+struct tarball_t;
+
+struct srcinfo_t {
+  char *pkgbase;
+  char *pkgver;
+  char *pkgrel;
+  char *epoch;
+
+  char **pkgnames;
+  size_t pkgname_count;
+
+  /* names from depends and makedepends of every section and architecture,
+   * without version constraints */
+  char **depends;
+  size_t depend_count;
+
+  /* local files the package is built from: sources without a URL, and the
+   * install and changelog files of every section */
+  char **files;
+  size_t file_count;
+};
+
+int srcinfo_parse(struct srcinfo_t *srcinfo, const char *data, size_t len);
+int srcinfo_read_tarball(struct srcinfo_t *srcinfo, const char *tarball_path);
+int srcinfo_read_memory(struct srcinfo_t *srcinfo, const void *data,
+    size_t len);
+int srcinfo_read_archive(struct srcinfo_t *srcinfo,
+    const struct tarball_t *tarball);
+void srcinfo_free(struct srcinfo_t *srcinfo);
+
+static inline void srcinfo_freep(struct srcinfo_t *srcinfo) {
+  srcinfo_free(srcinfo);
+}
+#define _cleanup_srcinfo_ _cleanup_(srcinfo_freep)
+
+/* Returns the full version, [epoch:]pkgver-pkgrel, as the AUR reports it. */
+char *srcinfo_version(const struct srcinfo_t *srcinfo);
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _SRCINFO_H */
@@ -0,0 +1,542 @@
+#include "tarball.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include "util.h"
+
+#define BLOCKSIZE 512
+
+struct tar_header_t {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char padding[12];
+};
+
+/* source archives are small, so always use the strongest setting */
+#define WRITER_LEVEL Z_BEST_COMPRESSION
+#define WRITER_CHUNK (64 * 1024)
+
+bool tarball_is_gzip(const void *data, size_t len) {
+  const unsigned char *p = data;
+
+  return len >= 2 && p[0] == 0x1f && p[1] == 0x8b;
+}
+
+int tarball_gunzip(const void *data, size_t len, size_t limit, char **out,
+    size_t *outlen, size_t *consumed) {
+  z_stream zs = {};
+  size_t alloc = len * 4;
+  char *buf = NULL;
+  bool full = false;
+  int r;
+
+  /* accept both gzip and zlib headers */
+  if (inflateInit2(&zs, 15 + 32) != Z_OK)
+    return -ENOMEM;
+
+  if (limit && alloc > limit / 2)
+    alloc = limit / 2;
+
+  zs.next_in = (unsigned char *)data;
+  zs.avail_in = len;
+
+  do {
+    char *newbuf;
+
+    alloc *= 2;
+    if (limit && alloc > limit)
+      alloc = limit;
+    newbuf = realloc(buf, alloc);
+    if (newbuf == NULL) {
+      r = Z_MEM_ERROR;
+      break;
+    }
+    buf = newbuf;
+
+    zs.next_out = (unsigned char *)buf + zs.total_out;
+    zs.avail_out = alloc - zs.total_out;
+
+    r = inflate(&zs, Z_NO_FLUSH);
+    full = limit && zs.total_out >= limit;
+  } while (!full && (r == Z_OK || (r == Z_BUF_ERROR && zs.avail_out == 0)));
+
+  inflateEnd(&zs);
+
+  if (r != Z_STREAM_END &&
+      !(full && (r == Z_OK || r == Z_BUF_ERROR))) {
+    free(buf);
+    return r == Z_MEM_ERROR ? -ENOMEM : -EBADMSG;
+  }
+
+  *out = buf;
+  *outlen = zs.total_out;
+  if (consumed)
+    *consumed = zs.total_in;
+
+  return 0;
+}
+
+static size_t parse_octal(const char *field, size_t len) {
+  size_t value = 0;
+
+  for (size_t i = 0; i < len && field[i]; i++) {
+    if (field[i] == ' ')
+      continue;
+    if (field[i] < '0' || field[i] > '7')
+      break;
+    value = value * 8 + (field[i] - '0');
+  }
+
+  return value;
+}
+
+static size_t header_checksum(const struct tar_header_t *header) {
+  const unsigned char *p = (const unsigned char *)header;
+  size_t sum = 0;
+
+  for (size_t i = 0; i < BLOCKSIZE; i++) {
+    if (i >= offsetof(struct tar_header_t, chksum) &&
+        i < offsetof(struct tar_header_t, chksum) + sizeof(header->chksum))
+      sum += ' ';
+    else
+      sum += p[i];
+  }
+
+  return sum;
+}
+
+static bool checksum_valid(const struct tar_header_t *header) {
+  return header_checksum(header) ==
+      parse_octal(header->chksum, sizeof(header->chksum));
+}
+
+static bool block_is_zero(const char *block) {
+  for (size_t i = 0; i < BLOCKSIZE; i++)
+    if (block[i])
+      return false;
+
+  return true;
+}
+
+static char *normalize_name(char *name) {
+  size_t len;
+
+  while (strncmp(name, "./", 2) == 0)
+    memmove(name, name + 2, strlen(name + 2) + 1);
+
+  len = strlen(name);
+  while (len > 0 && name[len - 1] == '/')
+    name[--len] = '\0';
+
+  return name;
+}
+
+/* Parse the records of a pax extended header, picking out the keys which
+ * override fields of the next entry. */
+static int parse_pax_header(const char *data, size_t len, char **path,
+    char **linkpath) {
+  const char *p = data, *end = data + len;
+
+  while (p < end) {
+    char *key, *eq, *record_end;
+    size_t reclen;
+
+    reclen = strtoul(p, &key, 10);
+    if (reclen == 0 || *key != ' ' || p + reclen > end)
+      return -EBADMSG;
+
+    key++;
+    record_end = (char *)p + reclen - 1;
+    eq = memchr(key, '=', record_end - key);
+    if (eq == NULL)
+      return -EBADMSG;
+
+    if ((size_t)(eq - key) == 4 && strncmp(key, "path", 4) == 0) {
+      free(*path);
+      *path = strndup(eq + 1, record_end - eq - 1);
+      if (*path == NULL)
+        return -ENOMEM;
+    } else if ((size_t)(eq - key) == 8 && strncmp(key, "linkpath", 8) == 0) {
+      free(*linkpath);
+      *linkpath = strndup(eq + 1, record_end - eq - 1);
+      if (*linkpath == NULL)
+        return -ENOMEM;
+    }
+
+    p += reclen;
+  }
+
+  return 0;
+}
+
+static int append_entry(struct tarball_t *tarball, struct tar_entry_t *entry) {
+  struct tar_entry_t *entries;
+
+  entries = realloc(tarball->entries,
+      (tarball->count + 1) * sizeof(*entries));
+  if (entries == NULL)
+    return -ENOMEM;
+
+  tarball->entries = entries;
+  tarball->entries[tarball->count++] = *entry;
+
+  return 0;
+}
+
+static int parse_archive(struct tarball_t *tarball) {
+  _cleanup_free_ char *longname = NULL, *longlink = NULL;
+  size_t offset = 0;
+  int r;
+
+  while (offset + BLOCKSIZE <= tarball->len) {
+    const struct tar_header_t *header =
+        (const struct tar_header_t *)(tarball->buf + offset);
+    struct tar_entry_t entry = {};
+    const char *data;
+    size_t size;
+
+    if (block_is_zero(tarball->buf + offset))
+      return 0;
+
+    if (!checksum_valid(header))
+      return -EBADMSG;
+
+    size = parse_octal(header->size, sizeof(header->size));
+    data = tarball->buf + offset + BLOCKSIZE;
+    offset += BLOCKSIZE + (size + BLOCKSIZE - 1) / BLOCKSIZE * BLOCKSIZE;
+    if (offset > tarball->len)
+      return -EBADMSG;
+
+    switch (header->typeflag) {
+    case 'x':
+      r = parse_pax_header(data, size, &longname, &longlink);
+      if (r < 0)
+        return r;
+      continue;
+    case 'L':
+      free(longname);
+      longname = strndup(data, size);
+      if (longname == NULL)
+        return -ENOMEM;
+      continue;
+    case 'K':
+      free(longlink);
+      longlink = strndup(data, size);
+      if (longlink == NULL)
+        return -ENOMEM;
+      continue;
+    case 'g':
+      continue;
+    }
+
+    if (longname) {
+      entry.name = longname;
+      longname = NULL;
+    } else if (header->prefix[0] && strncmp(header->magic, "ustar", 5) == 0) {
+      if (asprintf(&entry.name, "%.*s/%.*s",
+            (int)strnlen(header->prefix, sizeof(header->prefix)),
+            header->prefix,
+            (int)strnlen(header->name, sizeof(header->name)),
+            header->name) < 0)
+        return -ENOMEM;
+    } else {
+      entry.name = strndup(header->name, sizeof(header->name));
+      if (entry.name == NULL)
+        return -ENOMEM;
+    }
+
+    if (longlink) {
+      entry.linkname = longlink;
+      longlink = NULL;
+    } else if (header->linkname[0]) {
+      entry.linkname = strndup(header->linkname, sizeof(header->linkname));
+      if (entry.linkname == NULL) {
+        free(entry.name);
+        return -ENOMEM;
+      }
+    }
+
+    normalize_name(entry.name);
+    entry.type = header->typeflag ? header->typeflag : '0';
+    entry.mode = parse_octal(header->mode, sizeof(header->mode)) & 07777;
+    entry.data = data;
+    entry.size = size;
+
+    /* hard links carry no data of their own */
+    if (entry.type == '1' && entry.linkname) {
+      const struct tar_entry_t *target;
+
+      normalize_name(entry.linkname);
+      target = tarball_find(tarball, entry.linkname);
+      if (target) {
+        entry.type = '0';
+        entry.data = target->data;
+        entry.size = target->size;
+      }
+    }
+
+    if (entry.name[0] == '\0') {
+      free(entry.name);
+      free(entry.linkname);
+      continue;
+    }
+
+    r = append_entry(tarball, &entry);
+    if (r < 0) {
+      free(entry.name);
+      free(entry.linkname);
+      return r;
+    }
+  }
+
+  return 0;
+}
+
+int tarball_load_memory(struct tarball_t *tarball, const void *data,
+    size_t len) {
+  int r;
+
+  memset(tarball, 0, sizeof(*tarball));
+
+  if (tarball_is_gzip(data, len)) {
+    r = tarball_gunzip(data, len, 0, &tarball->buf, &tarball->len, NULL);
+    if (r < 0)
+      return r;
+  } else {
+    tarball->buf = malloc(len);
+    if (tarball->buf == NULL)
+      return -ENOMEM;
+    memcpy(tarball->buf, data, len);
+    tarball->len = len;
+  }
+
+  r = parse_archive(tarball);
+  if (r < 0)
+    tarball_free(tarball);
+
+  return r;
+}
+
+int tarball_load(struct tarball_t *tarball, const char *path) {
+  _cleanup_fclose_ FILE *fp = NULL;
+  _cleanup_free_ char *data = NULL;
+  struct stat st;
+
+  fp = fopen(path, "re");
+  if (fp == NULL)
+    return -errno;
+
+  if (fstat(fileno(fp), &st) < 0)
+    return -errno;
+
+  if (!S_ISREG(st.st_mode))
+    return -EINVAL;
+
+  data = malloc(st.st_size);
+  if (data == NULL)
+    return -ENOMEM;
+
+  if (fread(data, 1, st.st_size, fp) != (size_t)st.st_size)
+    return -EIO;
+
+  return tarball_load_memory(tarball, data, st.st_size);
+}
+
+void tarball_free(struct tarball_t *tarball) {
+  for (size_t i = 0; i < tarball->count; i++) {
+    free(tarball->entries[i].name);
+    free(tarball->entries[i].linkname);
+  }
+
+  free(tarball->entries);
+  free(tarball->buf);
+  memset(tarball, 0, sizeof(*tarball));
+}
+
+const struct tar_entry_t *tarball_find(const struct tarball_t *tarball,
+    const char *name) {
+  for (size_t i = 0; i < tarball->count; i++)
+    if (streq(tarball->entries[i].name, name))
+      return &tarball->entries[i];
+
+  return NULL;
+}
+
+/* Feeds len bytes at data to the compressor, growing the output buffer as
+ * needed. With Z_FINISH the stream is ended. */
+static int writer_deflate(struct tar_writer_t *writer, const void *data,
+    size_t len, int flush) {
+  z_stream *zs = &writer->zs;
+  int r;
+
+  if (len > UINT_MAX)
+    return -EFBIG;
+
+  zs->next_in = (unsigned char *)data;
+  zs->avail_in = len;
+
+  for (;;) {
+    if (zs->total_out == writer->alloc) {
+      size_t alloc = writer->alloc ? writer->alloc * 2 : WRITER_CHUNK;
+      char *buf = realloc(writer->buf, alloc);
+
+      if (buf == NULL)
+        return -ENOMEM;
+      writer->buf = buf;
+      writer->alloc = alloc;
+    }
+
+    zs->next_out = (unsigned char *)writer->buf + zs->total_out;
+    zs->avail_out = writer->alloc - zs->total_out;
+
+    r = deflate(zs, flush);
+    if (r == Z_STREAM_END)
+      return 0;
+    if (r != Z_OK && r != Z_BUF_ERROR)
+      return -EINVAL;
+    if (flush != Z_FINISH && zs->avail_in == 0 && zs->avail_out > 0)
+      return 0;
+  }
+}
+
+int tar_writer_init(struct tar_writer_t *writer) {
+  memset(writer, 0, sizeof(*writer));
+
+  /* 16 added to the window bits asks for a gzip header */
+  if (deflateInit2(&writer->zs, WRITER_LEVEL, Z_DEFLATED, 15 + 16, 9,
+        Z_DEFAULT_STRATEGY) != Z_OK)
+    return -ENOMEM;
+
+  return 0;
+}
+
+/* Fills a ustar header, splitting names longer than the name field at a
+ * slash into the prefix field. */
+static int fill_header(struct tar_header_t *header, const char *name,
+    char type, mode_t mode, time_t mtime, size_t size) {
+  size_t len = strlen(name), sum;
+
+  memset(header, 0, sizeof(*header));
+
+  if (len <= sizeof(header->name))
+    memcpy(header->name, name, len);
+  else {
+    const char *slash = strchr(name + len - sizeof(header->name) - 1, '/');
+
+    if (slash == NULL || (size_t)(slash - name) > sizeof(header->prefix))
+      return -ENAMETOOLONG;
+
+    memcpy(header->prefix, name, slash - name);
+    memcpy(header->name, slash + 1, len - (slash - name) - 1);
+  }
+
+  if ((unsigned long long)size > 077777777777ULL)
+    return -EFBIG;
+
+  snprintf(header->mode, sizeof(header->mode), "%07o",
+      (unsigned)(mode & 07777));
+  memcpy(header->uid, "0000000", 8);
+  memcpy(header->gid, "0000000", 8);
+  snprintf(header->size, sizeof(header->size), "%011llo",
+      (unsigned long long)size);
+  snprintf(header->mtime, sizeof(header->mtime), "%011llo",
+      (unsigned long long)(mtime > 0 ? mtime : 0) & 077777777777ULL);
+  header->typeflag = type;
+  memcpy(header->magic, "ustar", 6);
+  memcpy(header->version, "00", 2);
+  memcpy(header->uname, "root", 5);
+  memcpy(header->gname, "root", 5);
+
+  sum = header_checksum(header);
+  snprintf(header->chksum, sizeof(header->chksum), "%06o",
+      (unsigned)(sum & 0777777));
+  header->chksum[7] = ' ';
+
+  return 0;
+}
+
+int tar_writer_add(struct tar_writer_t *writer, const char *name, char type,
+    mode_t mode, time_t mtime, const void *data, size_t size) {
+  static const char zero[BLOCKSIZE];
+  struct tar_header_t header;
+  int r;
+
+  r = fill_header(&header, name, type, mode, mtime, size);
+  if (r < 0)
+    return r;
+
+  r = writer_deflate(writer, &header, sizeof(header), Z_NO_FLUSH);
+  if (r == 0 && size > 0)
+    r = writer_deflate(writer, data, size, Z_NO_FLUSH);
+  if (r == 0 && size % BLOCKSIZE)
+    r = writer_deflate(writer, zero, BLOCKSIZE - size % BLOCKSIZE,
+        Z_NO_FLUSH);
+
+  return r;
+}
+
+int tar_writer_finish(struct tar_writer_t *writer, char **out,
+    size_t *outlen) {
+  static const char end[2 * BLOCKSIZE];
+  int r;
+
+  r = writer_deflate(writer, end, sizeof(end), Z_FINISH);
+  if (r < 0)
+    return r;
+
+  *out = writer->buf;
+  *outlen = writer->zs.total_out;
+  writer->buf = NULL;
+  writer->alloc = 0;
+
+  return 0;
+}
+
+void tar_writer_free(struct tar_writer_t *writer) {
+  deflateEnd(&writer->zs);
+  free(writer->buf);
+  memset(writer, 0, sizeof(*writer));
+}
+
+int tarball_gzip(const void *data, size_t len, char **out, size_t *outlen) {
+  _cleanup_tar_writer_ struct tar_writer_t writer = {};
+  int r;
+
+  r = tar_writer_init(&writer);
+  if (r < 0)
+    return r;
+
+  r = writer_deflate(&writer, data, len, Z_FINISH);
+  if (r < 0)
+    return r;
+
+  *out = writer.buf;
+  *outlen = writer.zs.total_out;
+  writer.buf = NULL;
+
+  return 0;
+}
+
+/* vim: set et ts=2 sw=2: */
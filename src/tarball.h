@@ -0,0 +1,78 @@
+#ifndef _TARBALL_H
+#define _TARBALL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <zlib.h>
+
+#include "util.h"
+
+struct tar_entry_t {
+  char *name;
+  char *linkname;
+  char type;
+  mode_t mode;
+  const char *data;
+  size_t size;
+};
+
+/* An uncompressed tar archive held in memory. Entry data points into buf. */
+struct tarball_t {
+  char *buf;
+  size_t len;
+
+  struct tar_entry_t *entries;
+  size_t count;
+};
+
+int tarball_load(struct tarball_t *tarball, const char *path);
+int tarball_load_memory(struct tarball_t *tarball, const void *data,
+    size_t len);
+void tarball_free(struct tarball_t *tarball);
+
+const struct tar_entry_t *tarball_find(const struct tarball_t *tarball,
+    const char *name);
+
+static inline void tarball_freep(struct tarball_t *tarball) {
+  tarball_free(tarball);
+}
+#define _cleanup_tarball_ _cleanup_(tarball_freep)
+
+bool tarball_is_gzip(const void *data, size_t len);
+
+/* Decompresses the gzip stream at data, or with a non-zero limit only about
+ * its first limit bytes. consumed, if not NULL, receives the number of
+ * compressed bytes which were read to produce the output. */
+int tarball_gunzip(const void *data, size_t len, size_t limit, char **out,
+    size_t *outlen, size_t *consumed);
+
+/* Returns a gzip compressed copy of len bytes at data. */
+int tarball_gzip(const void *data, size_t len, char **out, size_t *outlen);
+
+/* Builds a gzip compressed ustar archive in memory. Each entry is compressed
+ * as it is added, so the uncompressed archive never exists as a whole. */
+struct tar_writer_t {
+  z_stream zs;
+  char *buf;
+  size_t alloc;
+};
+
+int tar_writer_init(struct tar_writer_t *writer);
+int tar_writer_add(struct tar_writer_t *writer, const char *name, char type,
+    mode_t mode, time_t mtime, const void *data, size_t size);
+/* Ends the archive and hands its buffer over to the caller. */
+int tar_writer_finish(struct tar_writer_t *writer, char **out,
+    size_t *outlen);
+void tar_writer_free(struct tar_writer_t *writer);
+
+static inline void tar_writer_freep(struct tar_writer_t *writer) {
+  tar_writer_free(writer);
+}
+#define _cleanup_tar_writer_ _cleanup_(tar_writer_freep)
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _TARBALL_H */
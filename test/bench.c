@@ -0,0 +1,317 @@
+/* Microbenchmarks for the parsing and bookkeeping helpers in aur.c and
+ * burp.c. Both translation units are included directly so their static
+ * functions can be called. Run with `make check-bench`, optionally passing
+ * a substring to select benchmarks: `make check-bench BENCH=cookies`. */
+
+#include <time.h>
+
+int burp_main(int argc, char *argv[]);
+
+#include "aur.c"
+
+#define main burp_main
+#include "burp.c"
+#undef main
+
+#define BENCH_MIN_NSEC  200000000ULL
+
+/* Count allocations by interposing the allocator. Calls are forwarded to
+ * glibc, so libcurl's allocations are counted as well. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long long alloc_count;
+
+void *malloc(size_t size) {
+  ++alloc_count;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  ++alloc_count;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  ++alloc_count;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+  __libc_free(ptr);
+}
+
+typedef void (*bench_fn)(void *arg);
+
+static const char *bench_filter;
+static volatile uintptr_t bench_sink;
+
+static unsigned long long now_nsec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Doubles the iteration count until a run takes at least BENCH_MIN_NSEC and
+ * reports the figures of that run. */
+static void bench_run(const char *name, bench_fn fn, void *arg) {
+  unsigned long long start, elapsed, allocs;
+  unsigned long iterations = 1;
+
+  if (bench_filter && strstr(name, bench_filter) == NULL)
+    return;
+
+  fn(arg);
+
+  for (;;) {
+    allocs = alloc_count;
+    start = now_nsec();
+    for (unsigned long i = 0; i < iterations; ++i)
+      fn(arg);
+    elapsed = now_nsec() - start;
+    allocs = alloc_count - allocs;
+
+    if (elapsed >= BENCH_MIN_NSEC)
+      break;
+    iterations *= 2;
+  }
+
+  printf("%-36s %10lu %14.1f ns/op %10.2f allocs/op\n", name, iterations,
+      (double)elapsed / iterations, (double)allocs / iterations);
+}
+
+/* synthetic inputs */
+
+static char *make_html(size_t size, const char *error) {
+  static const char filler[] =
+    "<div class=\"box\"><p>Lorem <b>ipsum</b> dolor sit amet, "
+    "<a href=\"/packages/\">consectetur</a> adipiscing elit.</p></div>\n";
+  size_t len = 0, error_len = error ? strlen(error) : 0;
+  char *html;
+
+  html = __libc_malloc(size + error_len + 1);
+  if (html == NULL)
+    return NULL;
+
+  while (len + sizeof(filler) - 1 <= size) {
+    memcpy(html + len, filler, sizeof(filler) - 1);
+    len += sizeof(filler) - 1;
+  }
+  /* pad to exactly size bytes so every byte handed out is initialized */
+  memset(html + len, ' ', size - len);
+  len = size;
+
+  if (error_len)
+    memcpy(html + len, error, error_len);
+  html[len + error_len] = '\0';
+
+  return html;
+}
+
+struct html_arg_t {
+  const char *html;
+  size_t len;
+};
+
+static void bench_strip_html_tags(void *arg) {
+  struct html_arg_t *a = arg;
+  char *out = strip_html_tags(a->html, a->len);
+
+  bench_sink = (uintptr_t)out;
+  free(out);
+}
+
+static void bench_extract_html(void *arg) {
+  struct html_arg_t *a = arg;
+  char *out = NULL;
+
+  extract_html(a->html, "<ul class=\"errorlist\">", "</ul>", &out);
+  bench_sink = (uintptr_t)out;
+  free(out);
+}
+
+static void bench_extract_html_error(void *arg) {
+  struct html_arg_t *a = arg;
+  char *out = NULL;
+
+  extract_html_error(a->html, &out);
+  bench_sink = (uintptr_t)out;
+  free(out);
+}
+
+static void run_html_benches(void) {
+  static const char error[] =
+    "<ul class=\"errorlist\"><li>You must create an account before you "
+    "can upload packages.</li></ul>";
+  static const size_t sizes[] = { 1024, 16384, 262144 };
+
+  for (size_t i = 0; i < ARRAYSIZE(sizes); ++i) {
+    char *html = make_html(sizes[i], error), *plain = make_html(sizes[i], NULL);
+    struct html_arg_t with_error = { html, strlen(html) };
+    struct html_arg_t without_error = { plain, strlen(plain) };
+    char name[64];
+
+    snprintf(name, sizeof(name), "strip_html_tags/%zu", sizes[i]);
+    bench_run(name, bench_strip_html_tags, &with_error);
+    snprintf(name, sizeof(name), "extract_html/%zu", sizes[i]);
+    bench_run(name, bench_extract_html, &with_error);
+    snprintf(name, sizeof(name), "extract_html_error/%zu", sizes[i]);
+    bench_run(name, bench_extract_html_error, &with_error);
+    snprintf(name, sizeof(name), "extract_html_error/none/%zu", sizes[i]);
+    bench_run(name, bench_extract_html_error, &without_error);
+
+    __libc_free(html);
+    __libc_free(plain);
+  }
+}
+
+/* cookies */
+
+static void bench_update_aursid(void *arg) {
+  aur_t *aur = arg;
+
+  bench_sink = (uintptr_t)update_aursid_from_cookies(aur);
+}
+
+/* Fills the jar with cookies for unrelated hosts and ends it with a valid
+ * session cookie, which is the worst case for the lookup. */
+static int fill_cookie_jar(aur_t *aur, int count) {
+  long expire = (long)time(NULL) + 86400;
+  char cookie[256];
+
+  curl_easy_setopt(aur->curl, CURLOPT_COOKIELIST, "ALL");
+
+  for (int i = 0; i < count - 1; ++i) {
+    snprintf(cookie, sizeof(cookie),
+        "host%d.example.org\tFALSE\t/\tFALSE\t%ld\tsession%d\t%08x",
+        i, expire, i, (unsigned)i * 2654435761U);
+    if (curl_easy_setopt(aur->curl, CURLOPT_COOKIELIST, cookie) != CURLE_OK)
+      return -EINVAL;
+  }
+
+  snprintf(cookie, sizeof(cookie),
+      "#HttpOnly_%s\tFALSE\t/\tTRUE\t%ld\tAURSID\t0123456789abcdef",
+      aur->domainname, expire);
+  if (curl_easy_setopt(aur->curl, CURLOPT_COOKIELIST, cookie) != CURLE_OK)
+    return -EINVAL;
+
+  return 0;
+}
+
+static void run_cookie_benches(void) {
+  static const int sizes[] = { 1, 100, 1000, 10000 };
+  _cleanup_aur_ aur_t *aur = NULL;
+
+  if (aur_new(&aur, "aur.archlinux.org", true) < 0 || curl_reset(aur) < 0) {
+    fprintf(stderr, "failed to create AUR client\n");
+    return;
+  }
+
+  for (size_t i = 0; i < ARRAYSIZE(sizes); ++i) {
+    char name[64];
+
+    if (fill_cookie_jar(aur, sizes[i]) < 0) {
+      fprintf(stderr, "failed to fill cookie jar\n");
+      return;
+    }
+
+    snprintf(name, sizeof(name), "update_aursid_from_cookies/%d", sizes[i]);
+    bench_run(name, bench_update_aursid, aur);
+  }
+}
+
+/* burp.c helpers */
+
+struct strtrim_arg_t {
+  const char *input;
+  char buf[256];
+};
+
+/* includes restoring the input, which strtrim modifies in place */
+static void bench_strtrim(void *arg) {
+  struct strtrim_arg_t *a = arg;
+
+  strcpy(a->buf, a->input);
+  bench_sink = strtrim(a->buf);
+}
+
+static void bench_category_validate(void *arg) {
+  bench_sink = (uintptr_t)category_validate(arg);
+}
+
+static void run_burp_benches(void) {
+  struct strtrim_arg_t trimmed = { "User=foo" };
+  struct strtrim_arg_t padded = { "   \t  Cookies   =   ~/.cache/burp/cookies  \t \n" };
+  char first[] = "daemons", last[] = "xfce", mixedcase[] = "Multimedia",
+       invalid[] = "nonexistent";
+
+  bench_run("strtrim/trimmed", bench_strtrim, &trimmed);
+  bench_run("strtrim/padded", bench_strtrim, &padded);
+
+  bench_run("category_validate/first", bench_category_validate, first);
+  bench_run("category_validate/last", bench_category_validate, last);
+  bench_run("category_validate/mixedcase", bench_category_validate, mixedcase);
+  bench_run("category_validate/invalid", bench_category_validate, invalid);
+}
+
+/* response buffering */
+
+#define RESPONSE_SIZE (1024 * 1024)
+
+struct write_arg_t {
+  const char *data;
+  size_t chunk;
+};
+
+/* one op is a complete response delivered in fixed size chunks */
+static void bench_write_handler(void *arg) {
+  struct write_arg_t *a = arg;
+  struct memblock_t response = { NULL, 0 };
+
+  for (size_t off = 0; off < RESPONSE_SIZE; off += a->chunk) {
+    size_t n = RESPONSE_SIZE - off < a->chunk ? RESPONSE_SIZE - off : a->chunk;
+    if (write_handler((void *)(a->data + off), n, 1, &response) != n)
+      break;
+  }
+
+  bench_sink = response.len;
+  free(response.data);
+}
+
+static void run_write_benches(void) {
+  static const size_t chunks[] = { 64, 1024, 4096, CURL_MAX_WRITE_SIZE };
+  char *data;
+
+  data = make_html(RESPONSE_SIZE, NULL);
+  if (data == NULL)
+    return;
+
+  for (size_t i = 0; i < ARRAYSIZE(chunks); ++i) {
+    struct write_arg_t arg = { data, chunks[i] };
+    char name[64];
+
+    snprintf(name, sizeof(name), "write_handler/1MiB/%zu", chunks[i]);
+    bench_run(name, bench_write_handler, &arg);
+  }
+
+  __libc_free(data);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 1 && *argv[1])
+    bench_filter = argv[1];
+
+  printf("%-36s %10s %17s %20s\n", "benchmark", "iterations", "time", "allocations");
+
+  run_html_benches();
+  run_cookie_benches();
+  run_burp_benches();
+  run_write_benches();
+
+  return EXIT_SUCCESS;
+}
+
+/* vim: set et ts=2 sw=2: */
@@ -0,0 +1,675 @@
+/* End-to-end check of the git backend. `git http-backend` is served as a CGI
+ * from a thread of this process, in front of a throwaway bare repository. A
+ * fixture tarball is pushed with aur_upload, and a changed version of it on
+ * top with aur_upload_memory. After each push the repository must pass
+ * `git fsck --strict`, and `git ls-tree` of master must list exactly the
+ * fixture's files with their modes and contents. A login with the wrong
+ * password must fail. Run with `make check-git`; the check is skipped when
+ * git is not installed. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "aur.h"
+#include "tarball.h"
+#include "util.h"
+
+#define GITPUSH_PKGBASE   "gitpush"
+#define GITPUSH_USER      "tester"
+#define GITPUSH_PASSWORD  "secret"
+/* base64 of GITPUSH_USER ":" GITPUSH_PASSWORD */
+#define GITPUSH_AUTH      "Basic dGVzdGVyOnNlY3JldA=="
+
+#define EXIT_SKIP 77
+
+struct fixture_file_t {
+  const char *path;
+  mode_t mode;
+  const char *data;
+};
+
+static const struct fixture_file_t fixture_v1[] = {
+  { "PKGBUILD", 0644, "pkgname=gitpush\npkgver=1\npkgrel=1\narch=(any)\n" },
+  { ".SRCINFO", 0644,
+    "pkgbase = gitpush\n\tpkgver = 1\n\tpkgrel = 1\n\npkgname = gitpush\n" },
+  { "fix.patch", 0644, "--- a\n+++ b\n" },
+  { "run.sh", 0755, "#!/bin/sh\nexec true\n" },
+  { "empty", 0644, "" },
+  { "files/conf/a.conf", 0644, "a = 1\n" },
+  { "files/b.conf", 0644, "b = 2\n" },
+  { NULL, 0, NULL },
+};
+
+static const struct fixture_file_t fixture_v2[] = {
+  { "PKGBUILD", 0644, "pkgname=gitpush\npkgver=1\npkgrel=2\narch=(any)\n" },
+  { ".SRCINFO", 0644,
+    "pkgbase = gitpush\n\tpkgver = 1\n\tpkgrel = 2\n\npkgname = gitpush\n" },
+  { "run.sh", 0644, "#!/bin/sh\nexec false\n" },
+  { "files/conf/a.conf", 0644, "a = 1\n" },
+  { "new.txt", 0644, "new\n" },
+  { NULL, 0, NULL },
+};
+
+/* git http-backend behind a minimal HTTP server */
+
+struct server_t {
+  int fd;
+  pthread_t thread;
+  char root[256];
+  char domain[32];
+};
+
+static int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static int read_all(int fd, char **out, size_t *outlen) {
+  _cleanup_free_ char *buf = NULL;
+  size_t alloc = 0, len = 0;
+
+  for (;;) {
+    ssize_t n;
+
+    if (len + 1 >= alloc) {
+      char *newbuf;
+
+      alloc = alloc ? alloc * 2 : 4096;
+      newbuf = realloc(buf, alloc);
+      if (newbuf == NULL)
+        return -ENOMEM;
+      buf = newbuf;
+    }
+
+    n = read(fd, buf + len, alloc - len - 1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    if (n == 0)
+      break;
+    len += n;
+  }
+
+  buf[len] = '\0';
+  *out = buf;
+  *outlen = len;
+  buf = NULL;
+
+  return 0;
+}
+
+static const char *header_value(const char *headers, const char *name) {
+  size_t len = strlen(name);
+
+  for (const char *p = strstr(headers, "\r\n"); p; p = strstr(p + 2, "\r\n"))
+    if (strncasecmp(p + 2, name, len) == 0 && p[2 + len] == ':')
+      return p + 3 + len + strspn(p + 3 + len, " ");
+
+  return "";
+}
+
+static char *header_dup(const char *headers, const char *name) {
+  const char *value = header_value(headers, name);
+
+  return strndup(value, strcspn(value, "\r\n"));
+}
+
+/* Runs git http-backend with the request body on stdin and returns what it
+ * printed: CGI headers, a blank line and the response body. */
+static int run_backend(struct server_t *server, const char *method,
+    const char *target, const char *content_type, int body_fd,
+    size_t body_len, char **out, size_t *outlen) {
+  _cleanup_free_ char *path = strndup(target, strcspn(target, "?"));
+  _cleanup_free_ char **envp = NULL;
+  char vars[8][512];
+  const char *query = strchr(target, '?');
+  size_t count = 0, n = 0;
+  int pipefd[2], status, r;
+  pid_t pid;
+
+  if (path == NULL)
+    return -ENOMEM;
+
+  while (environ[count])
+    ++count;
+
+  envp = calloc(count + ARRAYSIZE(vars) + 1, sizeof(*envp));
+  if (envp == NULL)
+    return -ENOMEM;
+
+  for (; n < count; ++n)
+    envp[n] = environ[n];
+
+  snprintf(vars[0], sizeof(vars[0]), "GIT_PROJECT_ROOT=%s", server->root);
+  snprintf(vars[1], sizeof(vars[1]), "GIT_HTTP_EXPORT_ALL=1");
+  snprintf(vars[2], sizeof(vars[2]), "PATH_INFO=%s", path);
+  snprintf(vars[3], sizeof(vars[3]), "QUERY_STRING=%s",
+      query ? query + 1 : "");
+  snprintf(vars[4], sizeof(vars[4]), "REQUEST_METHOD=%s", method);
+  snprintf(vars[5], sizeof(vars[5]), "CONTENT_TYPE=%s", content_type);
+  snprintf(vars[6], sizeof(vars[6]), "CONTENT_LENGTH=%zu", body_len);
+  /* receive-pack is only enabled for authenticated users */
+  snprintf(vars[7], sizeof(vars[7]), "REMOTE_USER=" GITPUSH_USER);
+  for (size_t i = 0; i < ARRAYSIZE(vars); ++i)
+    envp[n++] = vars[i];
+  envp[n] = NULL;
+
+  if (pipe2(pipefd, O_CLOEXEC) < 0)
+    return -errno;
+
+  pid = fork();
+  if (pid < 0) {
+    r = -errno;
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return r;
+  }
+
+  if (pid == 0) {
+    if (dup2(body_fd, STDIN_FILENO) < 0 || dup2(pipefd[1], STDOUT_FILENO) < 0)
+      _exit(127);
+    /* the backend complains on stderr about the repository the login
+     * probes, which does not exist */
+    execle("/bin/sh", "sh", "-c", "exec git http-backend 2>/dev/null",
+        (char *)NULL, envp);
+    _exit(127);
+  }
+
+  close(pipefd[1]);
+  r = read_all(pipefd[0], out, outlen);
+  close(pipefd[0]);
+
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    if (r == 0)
+      free(*out);
+    return -EIO;
+  }
+
+  return r;
+}
+
+static int respond_status(int fd, const char *status) {
+  char out[256];
+  int len;
+
+  len = snprintf(out, sizeof(out), "HTTP/1.1 %s\r\n"
+      "WWW-Authenticate: Basic realm=\"gitpush\"\r\n"
+      "Content-Length: 0\r\n"
+      "Connection: close\r\n\r\n", status);
+
+  return write_all(fd, out, len);
+}
+
+/* Turns the CGI output into an HTTP response. */
+static int respond_cgi(int fd, const char *cgi, size_t len) {
+  _cleanup_free_ char *head = NULL;
+  const char *end, *body, *status = "200 OK";
+  size_t head_len = 0;
+
+  end = strstr(cgi, "\r\n\r\n");
+  body = end ? end + 4 : NULL;
+  if (end == NULL) {
+    end = strstr(cgi, "\n\n");
+    body = end ? end + 2 : NULL;
+  }
+  if (end == NULL)
+    return -EBADMSG;
+
+  head = malloc(end - cgi + 128);
+  if (head == NULL)
+    return -ENOMEM;
+
+  for (const char *line = cgi; line < end; ) {
+    size_t n = strcspn(line, "\r\n");
+
+    if (strncasecmp(line, "Status:", 7) == 0)
+      status = line + 7 + strspn(line + 7, " ");
+    else {
+      memcpy(head + head_len, line, n);
+      memcpy(head + head_len + n, "\r\n", 2);
+      head_len += n + 2;
+    }
+
+    line += n;
+    line += strspn(line, "\r\n");
+  }
+
+  if (dprintf(fd, "HTTP/1.1 %.*s\r\n%.*sContent-Length: %zu\r\n"
+        "Connection: close\r\n\r\n", (int)strcspn(status, "\r\n"), status,
+        (int)head_len, head, len - (body - cgi)) < 0)
+    return -EIO;
+
+  return write_all(fd, body, len - (body - cgi));
+}
+
+/* Serves one request. Every response closes the connection, so there is no
+ * need to keep track of what is left on it. */
+static int serve(struct server_t *server, int fd) {
+  _cleanup_free_ char *auth = NULL, *content_type = NULL, *cgi = NULL;
+  _cleanup_fclose_ FILE *body = NULL;
+  char buf[16384], method[16], target[512];
+  size_t len = 0, body_len, cgi_len;
+  char *end;
+  int r;
+
+  for (;;) {
+    ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+    if (n <= 0)
+      return n < 0 ? -errno : -EPIPE;
+    len += n;
+    buf[len] = '\0';
+
+    end = strstr(buf, "\r\n\r\n");
+    if (end)
+      break;
+    if (len == sizeof(buf) - 1)
+      return -E2BIG;
+  }
+
+  end[2] = '\0';
+  if (sscanf(buf, "%15s %511s", method, target) != 2)
+    return -EBADMSG;
+
+  auth = header_dup(buf, "Authorization");
+  if (auth == NULL)
+    return -ENOMEM;
+  if (!streq(auth, GITPUSH_AUTH))
+    return respond_status(fd, "401 Unauthorized");
+
+  if (strncasecmp(header_value(buf, "Expect"), "100-continue", 12) == 0 &&
+      write_all(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25) < 0)
+    return -EIO;
+
+  content_type = header_dup(buf, "Content-Type");
+  if (content_type == NULL)
+    return -ENOMEM;
+  body_len = strtoul(header_value(buf, "Content-Length"), NULL, 10);
+
+  body = tmpfile();
+  if (body == NULL)
+    return -errno;
+
+  /* whatever followed the headers in the first read is body */
+  len -= end + 4 - buf;
+  fwrite(end + 4, 1, len, body);
+  while (len < body_len) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0)
+      return n < 0 ? -errno : -EPIPE;
+    fwrite(buf, 1, n, body);
+    len += n;
+  }
+
+  if (fflush(body) != 0 || lseek(fileno(body), 0, SEEK_SET) < 0)
+    return -EIO;
+
+  r = run_backend(server, method, target, content_type, fileno(body),
+      body_len, &cgi, &cgi_len);
+  if (r < 0)
+    return respond_status(fd, "500 Internal Server Error");
+
+  return respond_cgi(fd, cgi, cgi_len);
+}
+
+static void *server_thread(void *arg) {
+  struct server_t *server = arg;
+
+  for (;;) {
+    int fd = accept4(server->fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      break;
+    }
+
+    serve(server, fd);
+    close(fd);
+  }
+
+  return NULL;
+}
+
+static int server_start(struct server_t *server) {
+  union {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+  } addr = {
+    .in.sin_family = AF_INET,
+    .in.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  socklen_t addrlen = sizeof(addr.in);
+  int r;
+
+  server->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server->fd < 0)
+    return -errno;
+
+  if (bind(server->fd, &addr.sa, sizeof(addr.in)) < 0 ||
+      listen(server->fd, 16) < 0 ||
+      getsockname(server->fd, &addr.sa, &addrlen) < 0) {
+    r = -errno;
+    close(server->fd);
+    return r;
+  }
+
+  snprintf(server->domain, sizeof(server->domain), "127.0.0.1:%u",
+      ntohs(addr.in.sin_port));
+
+  r = -pthread_create(&server->thread, NULL, server_thread, server);
+  if (r < 0)
+    close(server->fd);
+
+  return r;
+}
+
+/* shutdown wakes the thread from accept, which then fails */
+static void server_stop(struct server_t *server) {
+  shutdown(server->fd, SHUT_RDWR);
+  pthread_join(server->thread, NULL);
+  close(server->fd);
+}
+
+/* fixtures and checks */
+
+static int build_fixture(const struct fixture_file_t *files, char **data,
+    size_t *len) {
+  _cleanup_tar_writer_ struct tar_writer_t writer = {};
+  int r;
+
+  r = tar_writer_init(&writer);
+  if (r == 0)
+    r = tar_writer_add(&writer, GITPUSH_PKGBASE "/", '5', 0755, 0, NULL, 0);
+
+  for (const struct fixture_file_t *f = files; r == 0 && f->path; ++f) {
+    char name[256];
+
+    snprintf(name, sizeof(name), GITPUSH_PKGBASE "/%s", f->path);
+    r = tar_writer_add(&writer, name, '0', f->mode, 0, f->data,
+        strlen(f->data));
+  }
+
+  if (r == 0)
+    r = tar_writer_finish(&writer, data, len);
+
+  return r;
+}
+
+/* Runs a shell command and returns its output, or NULL if it failed. */
+static char * __attribute__((format(printf, 1, 2))) run(const char *fmt, ...) {
+  _cleanup_free_ char *cmd = NULL;
+  char *out = NULL;
+  size_t len;
+  va_list ap;
+  FILE *fp;
+  int r;
+
+  va_start(ap, fmt);
+  r = vasprintf(&cmd, fmt, ap);
+  va_end(ap);
+  if (r < 0)
+    return NULL;
+
+  fp = popen(cmd, "re");
+  if (fp == NULL)
+    return NULL;
+
+  r = read_all(fileno(fp), &out, &len);
+  if (pclose(fp) != 0 || r < 0) {
+    if (r == 0)
+      free(out);
+    fprintf(stderr, "FAIL: %s\n", cmd);
+    return NULL;
+  }
+
+  return out;
+}
+
+static int check_tree(const char *repo, const struct fixture_file_t *files) {
+  _cleanup_free_ char *fsck = NULL, *tree = NULL;
+  size_t expected = 0, listed = 0;
+  char *line, *p;
+
+  fsck = run("git --git-dir='%s' fsck --strict --no-dangling 2>&1", repo);
+  if (fsck == NULL)
+    return -EBADMSG;
+
+  tree = run("git --git-dir='%s' ls-tree -r master", repo);
+  if (tree == NULL)
+    return -EBADMSG;
+
+  for (const struct fixture_file_t *f = files; f->path; ++f)
+    ++expected;
+
+  for (p = tree; (line = strsep(&p, "\n")) && *line; ++listed) {
+    _cleanup_free_ char *blob = NULL;
+    const struct fixture_file_t *f;
+    char mode[8], type[8], id[41], *path;
+
+    path = strchr(line, '\t');
+    if (path == NULL || sscanf(line, "%7s %7s %40s", mode, type, id) != 3) {
+      fprintf(stderr, "FAIL: unexpected ls-tree output: %s\n", line);
+      return -EBADMSG;
+    }
+    ++path;
+
+    for (f = files; f->path && !streq(f->path, path); ++f)
+      ;
+    if (f->path == NULL) {
+      fprintf(stderr, "FAIL: %s is not part of the fixture\n", path);
+      return -EBADMSG;
+    }
+
+    if (!streq(type, "blob") ||
+        !streq(mode, f->mode & 0111 ? "100755" : "100644")) {
+      fprintf(stderr, "FAIL: %s is a %s with mode %s\n", path, type, mode);
+      return -EBADMSG;
+    }
+
+    blob = run("git --git-dir='%s' cat-file blob %s", repo, id);
+    if (blob == NULL || !streq(blob, f->data)) {
+      fprintf(stderr, "FAIL: content of %s differs\n", path);
+      return -EBADMSG;
+    }
+  }
+
+  if (listed != expected) {
+    fprintf(stderr, "FAIL: master has %zu files, expected %zu\n", listed,
+        expected);
+    return -EBADMSG;
+  }
+
+  return 0;
+}
+
+static int check_history(const char *repo, unsigned long expected) {
+  _cleanup_free_ char *count = NULL;
+
+  count = run("git --git-dir='%s' rev-list --count master", repo);
+  if (count == NULL)
+    return -EBADMSG;
+
+  if (strtoul(count, NULL, 10) != expected) {
+    fprintf(stderr, "FAIL: master has %lu commits, expected %lu\n",
+        strtoul(count, NULL, 10), expected);
+    return -EBADMSG;
+  }
+
+  return 0;
+}
+
+static int check_login(const char *domain, const char *password,
+    int expected) {
+  aur_t *aur;
+  int r;
+
+  r = aur_new(&aur, domain, false);
+  if (r < 0)
+    return r;
+
+  aur_set_username(aur, GITPUSH_USER);
+  aur_set_password(aur, password);
+  aur_set_protocol(aur, AUR_PROTOCOL_GIT);
+
+  r = aur_login(aur, NULL);
+  aur_free(aur);
+
+  if (r != expected) {
+    fprintf(stderr, "FAIL: login with password '%s' returned %s\n",
+        password, r < 0 ? strerror(-r) : "success");
+    return -EBADMSG;
+  }
+
+  return 0;
+}
+
+static int push(aur_t *aur, const char *path, const char *data, size_t len) {
+  _cleanup_free_ char *error = NULL;
+  int r;
+
+  if (path)
+    r = aur_upload(aur, path, "none", &error);
+  else
+    r = aur_upload_memory(aur, GITPUSH_PKGBASE ".src.tar.gz", data, len,
+        "none", &error);
+
+  if (r < 0)
+    fprintf(stderr, "FAIL: push failed: %s\n", error ? error : strerror(-r));
+
+  return r;
+}
+
+static int run_checks(struct server_t *server, const char *repo) {
+  _cleanup_free_ char *v1 = NULL, *v2 = NULL, *path = NULL;
+  size_t v1_len, v2_len;
+  aur_t *aur = NULL;
+  int fd, r;
+
+  r = check_login(server->domain, "wrong", -EKEYREJECTED);
+  if (r == 0)
+    r = check_login(server->domain, GITPUSH_PASSWORD, 0);
+  if (r < 0)
+    return r;
+
+  r = build_fixture(fixture_v1, &v1, &v1_len);
+  if (r == 0)
+    r = build_fixture(fixture_v2, &v2, &v2_len);
+  if (r < 0)
+    return r;
+
+  /* the first version goes through a file on disk, like a makepkg tarball */
+  if (asprintf(&path, "%s/" GITPUSH_PKGBASE "-1-1.src.tar.gz",
+        server->root) < 0)
+    return -ENOMEM;
+
+  fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -errno;
+  r = write_all(fd, v1, v1_len);
+  close(fd);
+  if (r < 0)
+    return r;
+
+  r = aur_new(&aur, server->domain, false);
+  if (r < 0)
+    return r;
+
+  aur_set_username(aur, GITPUSH_USER);
+  aur_set_password(aur, GITPUSH_PASSWORD);
+  aur_set_protocol(aur, AUR_PROTOCOL_GIT);
+
+  r = aur_login(aur, NULL);
+  if (r == 0)
+    r = push(aur, path, NULL, 0);
+  if (r == 0)
+    r = check_tree(repo, fixture_v1);
+  if (r == 0)
+    r = check_history(repo, 1);
+  if (r == 0)
+    printf("ok: pushed a new repository from a tarball on disk\n");
+
+  if (r == 0)
+    r = push(aur, NULL, v2, v2_len);
+  if (r == 0)
+    r = check_tree(repo, fixture_v2);
+  if (r == 0)
+    r = check_history(repo, 2);
+  if (r == 0)
+    printf("ok: pushed an update from a tarball in memory\n");
+
+  aur_free(aur);
+  unlink(path);
+
+  return r;
+}
+
+int main(void) {
+  static struct server_t server;
+  const char *tmpdir = getenv("TMPDIR");
+  _cleanup_free_ char *repo = NULL, *out = NULL;
+  int r, ret = EXIT_FAILURE;
+
+  out = run("git --version");
+  if (out == NULL) {
+    fprintf(stderr, "git is not installed, skipping\n");
+    return EXIT_SKIP;
+  }
+
+  snprintf(server.root, sizeof(server.root), "%s/gitpush-XXXXXX",
+      tmpdir ? tmpdir : "/tmp");
+  if (mkdtemp(server.root) == NULL) {
+    fprintf(stderr, "failed to create directory: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (asprintf(&repo, "%s/" GITPUSH_PKGBASE ".git", server.root) < 0)
+    goto out_dir;
+
+  free(out);
+  out = run("git init -q --bare '%s'", repo);
+  if (out == NULL)
+    goto out_dir;
+
+  r = server_start(&server);
+  if (r < 0) {
+    fprintf(stderr, "failed to start server: %s\n", strerror(-r));
+    goto out_dir;
+  }
+
+  r = run_checks(&server, repo);
+  if (r == 0) {
+    printf("ok: login checks the password\n");
+    ret = EXIT_SUCCESS;
+  }
+
+  server_stop(&server);
+
+out_dir:
+  free(out);
+  out = run("rm -rf '%s'", server.root);
+
+  return ret;
+}
+
+/* vim: set et ts=2 sw=2: */
@@ -0,0 +1,656 @@
+/* Soak test for the client library. A mock AUR runs on a thread of this
+ * process and the client logs in, uploads, logs out and is freed again for
+ * a number of cycles, alternating between the blocking and the aur_multi_t
+ * interface. Memory and descriptor usage is sampled after a warmup and at
+ * the end of the run, and the test fails if either grew past its limit.
+ * Run with `make check-soak`, optionally passing `SOAK_CYCLES=n`. */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <malloc.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "aur.h"
+#include "util.h"
+
+#define SOAK_TARBALL_SIZE (64 * 1024)
+#define SOAK_MAX_FDS      16
+#define SOAK_MAX_CONNS    16
+
+/* mock server */
+
+struct conn_t {
+  int fd;
+  size_t len;
+  size_t body_left;
+  char path[256];
+  char buf[16384];
+};
+
+struct server_t {
+  int fd;
+  int wake[2];
+  pthread_t thread;
+  int connections;
+  unsigned long sessions;
+  char domain[32];
+  struct conn_t conns[SOAK_MAX_CONNS];
+};
+
+static int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static int respond(struct server_t *server, int fd, const char *path) {
+  char out[512];
+  int len;
+
+  if (streq(path, "/login"))
+    len = snprintf(out, sizeof(out), "HTTP/1.1 302 Found\r\n"
+        "Location: /\r\n"
+        "Set-Cookie: AURSID=soak%lu; Path=/; "
+        "Expires=Wed, 01 Jan 2100 00:00:00 GMT\r\n"
+        "Content-Length: 0\r\n\r\n", ++server->sessions);
+  else if (streq(path, "/submit"))
+    len = snprintf(out, sizeof(out), "HTTP/1.1 302 Found\r\n"
+        "Location: /pkgbase/soak/\r\n"
+        "Content-Length: 0\r\n\r\n");
+  else if (streq(path, "/logout"))
+    len = snprintf(out, sizeof(out), "HTTP/1.1 302 Found\r\n"
+        "Location: /\r\n"
+        "Set-Cookie: AURSID=; Path=/; "
+        "Expires=Thu, 01 Jan 1970 00:00:00 GMT\r\n"
+        "Content-Length: 0\r\n\r\n");
+  else
+    len = snprintf(out, sizeof(out), "HTTP/1.1 404 Not Found\r\n"
+        "Content-Length: 0\r\n\r\n");
+
+  return write_all(fd, out, len);
+}
+
+/* Consumes what has been read on a kept-alive connection. Request bodies are
+ * thrown away, and each request is answered once its body is complete. */
+static int conn_process(struct server_t *server, struct conn_t *conn) {
+  for (;;) {
+    size_t skip = conn->body_left < conn->len ? conn->body_left : conn->len;
+    char *end, *p;
+
+    memmove(conn->buf, conn->buf + skip, conn->len - skip);
+    conn->len -= skip;
+    conn->body_left -= skip;
+    if (conn->body_left > 0)
+      return 0;
+
+    if (conn->path[0]) {
+      if (respond(server, conn->fd, conn->path) < 0)
+        return -EIO;
+      conn->path[0] = '\0';
+    }
+
+    end = memmem(conn->buf, conn->len, "\r\n\r\n", 4);
+    if (end == NULL)
+      return conn->len < sizeof(conn->buf) - 1 ? 0 : -E2BIG;
+
+    *end = '\0';
+    if (sscanf(conn->buf, "%*s %255s", conn->path) != 1)
+      return -EBADMSG;
+
+    p = strcasestr(conn->buf, "\r\nContent-Length:");
+    conn->body_left = p ? strtoul(p + 17, NULL, 10) : 0;
+
+    skip = end + 4 - conn->buf;
+    memmove(conn->buf, conn->buf + skip, conn->len - skip);
+    conn->len -= skip;
+  }
+}
+
+static void conn_close(struct server_t *server, struct conn_t *conn) {
+  close(conn->fd);
+  conn->fd = -1;
+  __atomic_sub_fetch(&server->connections, 1, __ATOMIC_RELEASE);
+}
+
+static void server_accept(struct server_t *server) {
+  int fd;
+
+  fd = accept4(server->fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  for (size_t i = 0; i < SOAK_MAX_CONNS; ++i) {
+    struct conn_t *conn = &server->conns[i];
+
+    if (conn->fd < 0) {
+      conn->fd = fd;
+      conn->len = conn->body_left = 0;
+      conn->path[0] = '\0';
+      __atomic_add_fetch(&server->connections, 1, __ATOMIC_RELEASE);
+      return;
+    }
+  }
+
+  close(fd);
+}
+
+/* A client on the multi interface leaves its connection in the multi's
+ * cache, so the server must be able to hold more than one. */
+static void *server_thread(void *arg) {
+  struct server_t *server = arg;
+
+  for (;;) {
+    struct pollfd pfds[SOAK_MAX_CONNS + 2];
+    struct conn_t *polled[SOAK_MAX_CONNS];
+    nfds_t n = 2;
+
+    pfds[0] = (struct pollfd){ .fd = server->wake[0], .events = POLLIN };
+    pfds[1] = (struct pollfd){ .fd = server->fd, .events = POLLIN };
+    for (size_t i = 0; i < SOAK_MAX_CONNS; ++i) {
+      if (server->conns[i].fd < 0)
+        continue;
+      polled[n - 2] = &server->conns[i];
+      pfds[n++] = (struct pollfd){ .fd = server->conns[i].fd, .events = POLLIN };
+    }
+
+    if (poll(pfds, n, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    if (pfds[0].revents)
+      break;
+
+    for (nfds_t i = 2; i < n; ++i) {
+      struct conn_t *conn = polled[i - 2];
+      ssize_t r;
+
+      if (pfds[i].revents == 0)
+        continue;
+
+      r = read(conn->fd, conn->buf + conn->len,
+          sizeof(conn->buf) - 1 - conn->len);
+      if (r <= 0) {
+        conn_close(server, conn);
+        continue;
+      }
+
+      conn->len += r;
+      if (conn_process(server, conn) < 0)
+        conn_close(server, conn);
+    }
+
+    if (pfds[1].revents)
+      server_accept(server);
+  }
+
+  for (size_t i = 0; i < SOAK_MAX_CONNS; ++i)
+    if (server->conns[i].fd >= 0)
+      conn_close(server, &server->conns[i]);
+
+  return NULL;
+}
+
+static int server_start(struct server_t *server) {
+  union {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+  } addr = {
+    .in.sin_family = AF_INET,
+    .in.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  socklen_t addrlen = sizeof(addr.in);
+  int r;
+
+  for (size_t i = 0; i < SOAK_MAX_CONNS; ++i)
+    server->conns[i].fd = -1;
+
+  if (pipe2(server->wake, O_CLOEXEC) < 0)
+    return -errno;
+
+  server->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server->fd < 0) {
+    r = -errno;
+    goto fail_pipe;
+  }
+
+  if (bind(server->fd, &addr.sa, sizeof(addr.in)) < 0 ||
+      listen(server->fd, 16) < 0 ||
+      getsockname(server->fd, &addr.sa, &addrlen) < 0) {
+    r = -errno;
+    goto fail_socket;
+  }
+
+  snprintf(server->domain, sizeof(server->domain), "127.0.0.1:%u",
+      ntohs(addr.in.sin_port));
+
+  r = -pthread_create(&server->thread, NULL, server_thread, server);
+  if (r == 0)
+    return 0;
+
+fail_socket:
+  close(server->fd);
+fail_pipe:
+  close(server->wake[0]);
+  close(server->wake[1]);
+  return r;
+}
+
+static void server_stop(struct server_t *server) {
+  write_all(server->wake[1], "", 1);
+  pthread_join(server->thread, NULL);
+  close(server->fd);
+  close(server->wake[0]);
+  close(server->wake[1]);
+}
+
+/* resource usage */
+
+struct sample_t {
+  long rss_kib;
+  long fds;
+  long heap_kib;
+};
+
+static long sample_rss(void) {
+  _cleanup_fclose_ FILE *fp = NULL;
+  long pages;
+
+  fp = fopen("/proc/self/statm", "re");
+  if (fp == NULL || fscanf(fp, "%*d %ld", &pages) != 1)
+    return -1;
+
+  return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Counts the client's descriptors, leaving out the server's end of each
+ * connection. Those close asynchronously to the client, so the count is
+ * taken again if the server accepted or closed one in the meantime. */
+static long sample_fds(struct server_t *server) {
+  struct dirent *ent;
+  long count;
+  int connections;
+  DIR *dir;
+
+again:
+  connections = __atomic_load_n(&server->connections, __ATOMIC_ACQUIRE);
+  count = 0;
+
+  dir = opendir("/proc/self/fd");
+  if (dir == NULL)
+    return -1;
+
+  while ((ent = readdir(dir)) != NULL)
+    if (ent->d_name[0] != '.')
+      ++count;
+
+  closedir(dir);
+
+  if (connections != __atomic_load_n(&server->connections, __ATOMIC_ACQUIRE))
+    goto again;
+
+  /* nor the descriptor of the directory stream itself */
+  return count - 1 - connections;
+}
+
+/* Bytes in use in the main arena. The client only allocates on the calling
+ * thread, and the server thread allocates nothing, so this covers it. */
+static long sample_heap(void) {
+#ifdef HAVE_MALLINFO2
+  struct mallinfo2 mi = mallinfo2();
+
+  return (long)(mi.uordblks / 1024);
+#else
+  return 0;
+#endif
+}
+
+static void sample(struct server_t *server, struct sample_t *s) {
+  s->rss_kib = sample_rss();
+  s->fds = sample_fds(server);
+  s->heap_kib = sample_heap();
+}
+
+/* event loop for the aur_multi_t cycles */
+
+struct loop_t {
+  aur_multi_t *multi;
+  struct pollfd fds[SOAK_MAX_FDS];
+  nfds_t nfds;
+  long timeout_ms;
+};
+
+struct op_t {
+  bool done;
+  int result;
+};
+
+static void loop_socket(aur_multi_t *multi, int fd, int events,
+    void *userdata) {
+  struct loop_t *loop = userdata;
+  nfds_t i;
+
+  for (i = 0; i < loop->nfds; ++i)
+    if (loop->fds[i].fd == fd)
+      break;
+
+  if (events & AUR_POLL_REMOVE) {
+    if (i < loop->nfds)
+      loop->fds[i] = loop->fds[--loop->nfds];
+    return;
+  }
+
+  if (i == loop->nfds) {
+    if (loop->nfds == SOAK_MAX_FDS)
+      return;
+    ++loop->nfds;
+  }
+
+  loop->fds[i].fd = fd;
+  loop->fds[i].events = ((events & AUR_POLL_IN) ? POLLIN : 0) |
+      ((events & AUR_POLL_OUT) ? POLLOUT : 0);
+}
+
+static void loop_timer(aur_multi_t *multi, long timeout_ms, void *userdata) {
+  struct loop_t *loop = userdata;
+
+  loop->timeout_ms = timeout_ms;
+}
+
+static void op_done(aur_t *aur, int result, const char *error,
+    void *userdata) {
+  struct op_t *op = userdata;
+
+  op->done = true;
+  op->result = result;
+}
+
+static int loop_wait(struct loop_t *loop, struct op_t *op) {
+  while (!op->done) {
+    struct pollfd ready[SOAK_MAX_FDS];
+    nfds_t nready = 0;
+    int r;
+
+    r = poll(loop->fds, loop->nfds, loop->timeout_ms);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+
+    if (r == 0) {
+      loop->timeout_ms = -1;
+      r = aur_multi_timeout(loop->multi);
+      if (r < 0)
+        return r;
+      continue;
+    }
+
+    /* the callbacks may rearrange the set while we dispatch */
+    for (nfds_t i = 0; i < loop->nfds; ++i)
+      if (loop->fds[i].revents)
+        ready[nready++] = loop->fds[i];
+
+    for (nfds_t i = 0; i < nready; ++i) {
+      int events = 0;
+
+      if (ready[i].revents & (POLLIN | POLLHUP | POLLERR))
+        events |= AUR_POLL_IN;
+      if (ready[i].revents & POLLOUT)
+        events |= AUR_POLL_OUT;
+
+      r = aur_multi_socket_action(loop->multi, ready[i].fd, events);
+      if (r < 0)
+        return r;
+    }
+  }
+
+  return op->result;
+}
+
+/* cycles */
+
+struct soak_t {
+  struct server_t server;
+  struct loop_t loop;
+  char tarball[64];
+};
+
+static int cycle_blocking(aur_t *aur, const char *tarball) {
+  char *error = NULL;
+  int r;
+
+  r = aur_login(aur, &error);
+  free(error);
+  if (r < 0)
+    return r;
+
+  r = aur_upload(aur, tarball, "devel", &error);
+  free(error);
+  if (r < 0)
+    return r;
+
+  return aur_logout(aur);
+}
+
+static int cycle_async(aur_t *aur, struct loop_t *loop, const char *tarball) {
+  struct op_t op = { false, 0 };
+  int r;
+
+  r = aur_login_async(loop->multi, aur, op_done, &op);
+  if (r < 0 || (r = loop_wait(loop, &op)) < 0)
+    return r;
+
+  op.done = false;
+  r = aur_upload_async(loop->multi, aur, tarball, "devel", op_done, &op);
+  if (r < 0 || (r = loop_wait(loop, &op)) < 0)
+    return r;
+
+  op.done = false;
+  r = aur_logout_async(loop->multi, aur, op_done, &op);
+  if (r < 0)
+    return r;
+
+  return loop_wait(loop, &op);
+}
+
+static int run_cycle(struct soak_t *soak, bool async) {
+  aur_t *aur;
+  int r;
+
+  r = aur_new(&aur, soak->server.domain, false);
+  if (r < 0)
+    return r;
+
+  r = aur_set_username(aur, "soak");
+  if (r == 0)
+    r = aur_set_password(aur, "soak");
+  if (r == 0)
+    r = async ? cycle_async(aur, &soak->loop, soak->tarball) :
+        cycle_blocking(aur, soak->tarball);
+
+  aur_free(aur);
+
+  return r;
+}
+
+static int make_tarball(char *path, size_t size) {
+  const char *tmpdir = getenv("TMPDIR");
+  char buf[4096];
+  uint32_t x = 2463534242U;
+  int fd, r = 0;
+
+  snprintf(path, size, "%s/soak-XXXXXX", tmpdir ? tmpdir : "/tmp");
+  fd = mkostemp(path, O_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+
+  /* the mock server never looks inside, any bytes will do */
+  for (size_t n = 0; n < SOAK_TARBALL_SIZE && r == 0; n += sizeof(buf)) {
+    for (size_t i = 0; i < sizeof(buf); ++i) {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      buf[i] = (char)x;
+    }
+    r = write_all(fd, buf, sizeof(buf));
+  }
+
+  close(fd);
+  if (r < 0)
+    unlink(path);
+
+  return r;
+}
+
+static void print_sample(const char *label, const struct sample_t *s) {
+  printf("%-10s %10ld %6ld %10ld\n", label, s->rss_kib, s->fds, s->heap_kib);
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: soak [options]\n\n"
+      "  -n, --cycles=N      login/upload/logout cycles to run (default: 2000)\n"
+      "  -w, --warmup=N      cycles to run before the baseline (default: 100)\n"
+      "  -r, --max-rss=KiB   allowed growth of the resident set (default: 2048)\n"
+      "  -H, --max-heap=KiB  allowed growth of the heap (default: 256)\n"
+      "  -f, --max-fds=N     allowed growth of open descriptors (default: 0)\n");
+}
+
+int main(int argc, char *argv[]) {
+  static const struct option opts[] = {
+    { "cycles",   required_argument, 0, 'n' },
+    { "warmup",   required_argument, 0, 'w' },
+    { "max-rss",  required_argument, 0, 'r' },
+    { "max-heap", required_argument, 0, 'H' },
+    { "max-fds",  required_argument, 0, 'f' },
+    { 0, 0, 0, 0 }
+  };
+  unsigned long cycles = 2000, warmup = 100, every;
+  long max_rss = 2048, max_heap = 256, max_fds = 0;
+  static struct soak_t soak = { .loop.timeout_ms = -1 };
+  struct sample_t base, s;
+  int opt, r, ret = EXIT_FAILURE;
+
+  while ((opt = getopt_long(argc, argv, "n:w:r:H:f:", opts, NULL)) != -1) {
+    switch (opt) {
+      case 'n':
+        cycles = strtoul(optarg, NULL, 10);
+        break;
+      case 'w':
+        warmup = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        max_rss = strtol(optarg, NULL, 10);
+        break;
+      case 'H':
+        max_heap = strtol(optarg, NULL, 10);
+        break;
+      case 'f':
+        max_fds = strtol(optarg, NULL, 10);
+        break;
+      default:
+        usage();
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (cycles == 0) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  r = make_tarball(soak.tarball, sizeof(soak.tarball));
+  if (r < 0) {
+    fprintf(stderr, "failed to create tarball: %s\n", strerror(-r));
+    return EXIT_FAILURE;
+  }
+
+  r = server_start(&soak.server);
+  if (r < 0) {
+    fprintf(stderr, "failed to start mock server: %s\n", strerror(-r));
+    goto out_tarball;
+  }
+
+  r = aur_multi_new(&soak.loop.multi, loop_socket, loop_timer, &soak.loop);
+  if (r < 0) {
+    fprintf(stderr, "failed to create multi handle: %s\n", strerror(-r));
+    goto out_server;
+  }
+
+  printf("%-10s %10s %6s %10s\n", "cycle", "rss_kib", "fds", "heap_kib");
+
+  for (unsigned long i = 0; i < warmup; ++i) {
+    r = run_cycle(&soak, i % 2);
+    if (r < 0)
+      goto out_cycle;
+  }
+
+  sample(&soak.server, &base);
+  print_sample("baseline", &base);
+
+  every = cycles >= 10 ? cycles / 10 : 1;
+  for (unsigned long i = 1; i <= cycles; ++i) {
+    r = run_cycle(&soak, i % 2);
+    if (r < 0)
+      goto out_cycle;
+
+    if (i % every == 0 || i == cycles) {
+      char label[16];
+
+      sample(&soak.server, &s);
+      snprintf(label, sizeof(label), "%lu", i);
+      print_sample(label, &s);
+    }
+  }
+
+  printf("%-10s %+10ld %+6ld %+10ld\n", "growth", s.rss_kib - base.rss_kib,
+      s.fds - base.fds, s.heap_kib - base.heap_kib);
+
+  ret = EXIT_SUCCESS;
+  if (s.rss_kib - base.rss_kib > max_rss) {
+    fprintf(stderr, "FAIL: resident set grew by %ld KiB (limit %ld KiB)\n",
+        s.rss_kib - base.rss_kib, max_rss);
+    ret = EXIT_FAILURE;
+  }
+  if (s.heap_kib - base.heap_kib > max_heap) {
+    fprintf(stderr, "FAIL: heap grew by %ld KiB (limit %ld KiB)\n",
+        s.heap_kib - base.heap_kib, max_heap);
+    ret = EXIT_FAILURE;
+  }
+  if (s.fds - base.fds > max_fds) {
+    fprintf(stderr, "FAIL: %ld descriptors leaked (limit %ld)\n",
+        s.fds - base.fds, max_fds);
+    ret = EXIT_FAILURE;
+  }
+
+out_cycle:
+  if (r < 0)
+    fprintf(stderr, "cycle failed: %s\n", strerror(-r));
+  aur_multi_free(soak.loop.multi);
+out_server:
+  server_stop(&soak.server);
+out_tarball:
+  unlink(soak.tarball);
+
+  return ret;
+}
+
+/* vim: set et ts=2 sw=2: */